@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -5,54 +6,360 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <pthread.h>
-
+#include <errno.h>
+#include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <signal.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
 
+#include <linux/io_uring.h>
+#include <zlib.h>
+
 #include "cv.h"
 #include "highgui.h"
 
 typedef unsigned char uint8;
 typedef unsigned short uint16;
 
-static int tty_fd;
 static pthread_t cmd_thread;
-static pthread_t comm_thread;
-static pthread_t intel_thread;
 static pthread_t bt_thread;
-static pthread_t camera_thread;
+static pthread_t watchdog_thread;
+static pthread_t metrics_thread;
+static pthread_t debug_thread;
+static pthread_t init_thread;
+static pthread_t main_thread;
 static void* cmd_thread_status;
-static void* comm_thread_status;
-static void* intel_thread_status;
 static void* bt_thread_status;
-static void* camera_thread_status;
+static void* watchdog_thread_status;
+
+/*
+	Each camera runs its own capture and analysis thread. Cameras are
+	listed in priority order: the first one is the front camera that
+	steers, the others can declare victory or stand in for it when it
+	has no opinion.
+*/
+#define MAX_CAMERAS		4
+#define COLOR_CLASSES		4	/* every color id is classified in each frame */
+
+struct camera_s
+{
+	int id;
+	struct vehicle_s* vehicle;	/* the car it steers */
+	int index;		/* device index, or -1 to replay source */
+	char* source;		/* video file replayed instead of a device */
+	int cpu;		/* CPU the thread is pinned to, or -1 */
+	pthread_t thread;
+	void* thread_status;
+	int direction;		/* latest decision of this camera */
+	int steering;
+	unsigned long frames;		/* metrics, see METRIC_ADD() */
+	unsigned long capture_ns;
+	unsigned long analysis_ns;
+	unsigned long tiles;		/* classifier tiles seen and classified */
+	unsigned long tiles_scanned;
+	unsigned int coverage[COLOR_CLASSES][3];	/* per mille of each section, by color id */
+	int blobs;			/* of the target colour in the last frame */
+	unsigned long marker_area;	/* pixels of the victory marker, 0 when none */
+	int qualify;			/* threshold the last frame was classified with */
+	struct recorder_s* recorder;	/* NULL when not recording */
+};
+typedef struct camera_s camera_t;
+
+static camera_t cameras[MAX_CAMERAS];
+static int ncameras = 0;
+
+/*
+	Scheduling of each thread when running with --realtime. The sensor
+	watchdog preempts everything, then the serial reader and the
+	controller preempt vision and the REPL, everything else stays
+	under the default scheduler. The debug stream always runs under
+	SCHED_IDLE, realtime or not: it only gets what nobody else wants.
+*/
+struct thread_config_s
+{
+	char* name;
+	int policy;		/* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+	int priority;
+	int cpu;		/* CPU the thread is pinned to, or -1 */
+};
+typedef struct thread_config_s thread_config_t;
+
+#define THREAD_CMD		0
+#define THREAD_COMM		1
+#define THREAD_INTEL		2
+#define THREAD_BT		3
+#define THREAD_CAMERA		4
+#define THREAD_WATCHDOG		5
+#define THREAD_METRICS		6
+#define THREAD_INIT		7
+#define THREAD_DEBUG		8
+#define THREAD_RECORD		9
+#define THREAD_EVALUATE		10
+
+static thread_config_t thread_configs[] =
+{
+	{ "cmd", SCHED_OTHER, 0, -1 },
+	{ "comm", SCHED_FIFO, 80, -1 },
+	{ "intel", SCHED_FIFO, 70, -1 },
+	{ "bt", SCHED_OTHER, 0, -1 },
+	{ "camera", SCHED_OTHER, 0, -1 },
+	{ "watchdog", SCHED_FIFO, 90, -1 },
+	{ "metrics", SCHED_OTHER, 0, -1 },
+	{ "init", SCHED_OTHER, 0, -1 },
+	{ "debug", SCHED_IDLE, 0, -1 },
+	{ "record", SCHED_OTHER, 0, -1 },
+	{ "evaluate", SCHED_OTHER, 0, -1 }
+};
+
+#define RT_PROBE_LOOPS		1000
+#define RT_PROBE_INTERVAL	1000	/* us */
 
-char default_tty_dev[] = "/dev/ttyACM0";
+#define DEFAULT_TTY_DEV		"/dev/ttyACM0"
+#define DEFAULT_BAUD		9600
 
 #define NELEMENTS(_array)	(sizeof(_array) / sizeof(_array[0]))
 
+#ifndef MIN
+#define MIN(_a, _b)		(((_a) < (_b)) ? (_a) : (_b))
+#define MAX(_a, _b)		(((_a) > (_b)) ? (_a) : (_b))
+#endif
+
 // Camera stuff
 #define DEBUGMODE
 #define QUALIFY_THRESHOLD (83)
 #define VICTORY_THRESHOLD (95)
 #define DIRECTION_THRESHOLD (59) 
+#define CAMERA_FOV (60) /* horizontal field of view, in degrees */
+#define STEER_DEADBAND (4) /* degrees */
+#define STEER_HARD_ANGLE (18) /* degrees */
+#define DECISION_SMOOTHING (0.3) /* weight of the newest frame in the moving average */
+#define DECISION_HYSTERESIS (4) /* percent, added to enter a decision and removed to leave it */
+#define STEER_PUBLISH_DELTA (2) /* degrees of change before steering is republished */
+#define VISION_FPS_MAX (30) /* frame rate at full speed */
+#define VISION_FPS_MIN (8) /* frame rate at the slowest driving speed */
+#define VISION_FPS_IDLE (2) /* frame rate when nothing depends on vision */
+#define VISION_REPORT_INTERVAL (5000) /* ms between debug reports */
+#define DEBUG_STREAM_FPS (5) /* frames a second sent to the debug stream */
+#define RECORD_FRAMES (300) /* frames in each recording file */
+#define RECORD_BUFFERS (32) /* frames a camera can be ahead of its recorder */
+#define CHANGE_THRESHOLD (16) /* channel difference of a sample that marks its tile as changed */
+#define RESCAN_INTERVAL (30) /* frames between full rescans, however static the scene */
+#define THRESHOLD_PERCENT (90) /* percent of the frame darker than the threshold, in percentile mode */
+#define THRESHOLD_SMOOTHING (0.1) /* weight of the newest frame's threshold */
+#define LINE_KP (1.0) /* degrees of steering per degree of line error */
+#define LINE_KI (0.0) /* per degree second */
+#define LINE_KD (0.05) /* per degree per second */
+
+// Driving
+#define BACKUP_DISTANCE (35) /* center reading that starts the crazy backup */
+#define AVOID_DISTANCE (55) /* side reading that starts a soft turn away */
+#define CRUISE_SPEED (127)
+#define BACKUP_TIME (1000) /* ms, each phase of the crazy backup */
+#define DANCE_TIME (10000) /* ms */
+
+/*
+	Camera threads only touch a vehicle's wanted direction and steering
+	through publish_decision(), which merges the decisions of the
+	cameras of that vehicle, bumps its sequence number and wakes its
+	controller when, and only when, the merged view changed.
+*/
+static pthread_mutex_t decision_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t decision_cond = PTHREAD_COND_INITIALIZER;
+
+/* with the io_uring backend the reactor submits the tty queues itself */
+static int tty_deferred = 0;
+static int quiet = 0;		/* benchmarks mute the command log */
+
+/* syscalls issued by the serial and reactor I/O paths, for --bench-io */
+static unsigned long io_syscalls = 0;
+
+/*
+	Counters served by the metrics endpoint. Writers bump them with
+	relaxed atomic adds and never take a lock; the endpoint thread only
+	loads them, so a scrape does not slow down the paths it measures.
+*/
+#define METRIC_ADD(_counter, _n)	__atomic_fetch_add(&(_counter), (_n), __ATOMIC_RELAXED)
+#define METRIC_GET(_counter)		__atomic_load_n(&(_counter), __ATOMIC_RELAXED)
+
+struct metrics_s
+{
+	unsigned long serial_bytes_in;
+	unsigned long serial_bytes_out;
+	unsigned long serial_writes;
+	unsigned long commands_sent;
+	unsigned long serial_errors;	/* bytes from the Teensy outside a report */
+	unsigned long repl_errors;	/* rejected REPL commands */
+	unsigned long telemetry_sent;
+	unsigned long telemetry_failed;
+};
+typedef struct metrics_s metrics_t;
+
+static metrics_t metrics;
+static int metrics_fd = -1;
+static const char* metrics_path = NULL;	/* unix socket to unlink on exit */
+static int debug_fd = -1;		/* debug stream listener */
+
+/* cfg->io, until io_uring falls back to epoll, see run_event_loop() */
+static int event_loop = 0;
+static int decision_event_fd = -1;
 
-/* these are mainly  for bluetooth output */
-int GLOBAL_SPEED = 0; 
-int GLOBAL_MODE = 0; 
-int GLOBAL_SENSOR_RIGHT = 0;
-int GLOBAL_SENSOR_LEFT = 0; 
-int GLOBAL_SENSOR_CENTER = 0; 
+static struct timespec start_time;
+static long first_command_us = -1;	/* time-to-first-command, from main() */
 
 /*
-	-2 is default (consider making teensy wait) 
-	-1 is victory
-	1 is left
-	2 is middle
-	3 is right
+	Stop token. request_stop() sets the flag and makes stop_fd readable
+	for good, so every thread notices it either by checking the flag or
+	by polling stop_fd next to whatever it is waiting on.
 */
-int GLOBAL_WANTED_DIRECTION = 0; 
+static int stop_requested = 0;
+static int stop_fd = -1;
+static int signal_fd = -1;
+static struct timespec stop_time;
+
+#define INTEL_START		0
+#define INTEL_DRIVE		1
+#define INTEL_DANCE		2
+#define INTEL_BACKUP_STOP	3
+#define INTEL_BACKUP_TURN	4
+
+#define TELEMETRY_INTERVAL	1000	/* ms */
+
+/*
+	Sensor freshness. comm_feed() stamps every distance it stores, and
+	the watchdog stops the car as soon as one of them is older than
+	cfg->sensor_deadline, until the Teensy reports all of them again. The
+	car starts out stale, so it does not move on the zeroed defaults.
+*/
+#define SENSOR_LEFT		0
+#define SENSOR_RIGHT		1
+#define SENSOR_CENTER		2
+
+#define SENSOR_DEADLINE		250	/* ms, default of sensor-deadline */
+#define WATCHDOG_PERIOD		10	/* ms between freshness checks */
+#define TTY_WRITE_TIMEOUT	100	/* ms a full tty may hold up a write */
+
+/*
+	Line following. The camera fits the line to the centroids of the
+	line's pixels in LINE_BANDS horizontal bands and hands the fit to
+	its car's controller every frame, which steers with a PID loop on
+	the bearing error. A fit older than LINE_DEADLINE, or made from
+	fewer than LINE_MIN_BANDS bands, is not followed.
+*/
+#define LINE_BANDS		8
+#define LINE_MIN_BANDS		2
+#define LINE_BAND_MIN		5	/* per mille of a band the line must cover to count */
+#define LINE_DEADLINE		500	/* ms */
+
+struct line_s
+{
+	int valid;
+	int camera;		/* that saw it */
+	int bands;		/* the fit used */
+	double heading;		/* degrees between the line and the camera axis, positive to the right */
+	double offset;		/* of the line at the camera, cm when calibrated, else pixels; positive right */
+	double error;		/* degrees, heading plus the bearing of the offset at the lookahead */
+	struct timespec captured;	/* CLOCK_MONOTONIC of the frame */
+};
+typedef struct line_s line_t;
+
+struct line_pid_s
+{
+	int primed;
+	struct timespec last;	/* capture time of the last line steered by */
+	double last_error;
+	double integral;	/* degree seconds */
+	double dither;		/* of the steering position, see steer_graded() */
+};
+typedef struct line_pid_s line_pid_t;
+
+/*
+	Everything that belongs to one car: its serial link, the Teensy's
+	reports and the controller. One process drives up to MAX_VEHICLES
+	cars, which share the REPL, the watchdog, telemetry and, in event
+	loop mode, a single reactor; each camera steers one of them.
+*/
+#define MAX_VEHICLES		16
+
+struct vehicle_s
+{
+	int id;
+	int tty_fd;
+
+	/*
+		Outbound serial queue. Commands sent between tty_begin_batch()
+		and tty_end_batch() leave in a single write(). The mutex is
+		recursive so that a batch can span several commands.
+	*/
+	pthread_mutex_t tty_mutex;
+	uint8 tty_out[256];
+	int tty_out_len;
+	int tty_batch;
+	int last_sent[256];
+
+	/* these are mainly  for bluetooth output */
+	int speed;
+	int mode;
+	int state;			/* last state we commanded */
+	int sensor[3];			/* indexed by SENSOR_LEFT... */
+	long sensor_stamp[3];		/* monotonic ms of the last update */
+	int sensor_stale;
+	uint8 comm_pending;
+
+	/*
+		-2 is default (consider making teensy wait) 
+		-1 is victory
+		1 is left
+		2 is middle
+		3 is right
+	*/
+	int wanted_direction;
+
+	/*
+		Angle in degrees between the camera axis and the centroid of the
+		qualifying pixels, positive when the mass is right of centre.
+	*/
+	int wanted_steering;
+	line_t line;			/* latest fit, see publish_line() */
+	line_pid_t line_pid;		/* controller only */
+	unsigned long decision_seq;
+	unsigned long decision_seen;	/* by the reactor */
+
+	int intel_phase;
+	struct timespec intel_until;
+
+	pthread_t comm_thread;
+	pthread_t intel_thread;
+	int intel_timer;		/* reactors only */
+	uint8 tty_in[64];		/* io_uring only */
+	uint8 inflight[256];
+	int inflight_len;
+	int writing;
+};
+typedef struct vehicle_s vehicle_t;
+
+static vehicle_t vehicles[MAX_VEHICLES];
+static int nvehicles = 0;
+static vehicle_t* repl_vehicle = &vehicles[0];	/* target of REPL commands */
 
 #define CMD_TEENSY_MODE		(0x80 | 0x01)
 #define CMD_CHANGE_STATE	(0x80 | 0x02)
@@ -65,6 +372,12 @@ int GLOBAL_WANTED_DIRECTION = 0;
 #define CMD_SPEED		(0x80 | 0x31)
 #define CMD_HELP		(0x00 | 0x01)
 #define CMD_QUIT		(0x00 | 0x02)
+#define CMD_COLOR		(0x00 | 0x03)
+#define CMD_QUALIFY		(0x00 | 0x04)
+#define CMD_VICTORY		(0x00 | 0x05)
+#define CMD_DIRECTION		(0x00 | 0x06)
+#define CMD_VEHICLE		(0x00 | 0x07)
+#define CMD_CALIBRATE		(0x00 | 0x08)
 #define CMD_UNKNOWN		(0x80 | 0xFF)
 
 #define STATE_NOTHING		0x00
@@ -82,6 +395,121 @@ int GLOBAL_WANTED_DIRECTION = 0;
 #define TURN_LEFT		0x20
 #define TURN_UNKNOWN		0xFF
 
+/* values follow the BGR channel order, white needs all three */
+#define COLOR_BLUE		0x00
+#define COLOR_GREEN		0x01
+#define COLOR_RED		0x02
+#define COLOR_WHITE		0x03
+#define COLOR_UNKNOWN		0xFF
+
+/*
+	Everything that used to be compiled in, defaulting to the #defines
+	above. main() fills it in once, from the file named by --config
+	and then from the command line, before it starts any thread;
+	afterwards it is only read, through cfg, without any locking.
+*/
+struct config_s
+{
+	char device[MAX_VEHICLES][64];	/* one serial link per car */
+	int ndevices;
+	int device_layer;		/* where the device list came from, see config_set() */
+	int baud;
+	char telemetry_address[18];
+	int telemetry_psm;
+	int telemetry_interval;		/* ms */
+	int sensor_deadline;		/* ms */
+	int backup_distance;
+	int avoid_distance;
+	int cruise_speed;
+	int backup_time;		/* ms */
+	int dance_time;			/* ms */
+	int color;
+	int qualify;
+	int victory;
+	int direction;
+	int camera_fov;
+	int steer_deadband;
+	int steer_hard_angle;
+	double decision_smoothing;
+	int decision_hysteresis;
+	int steer_publish_delta;
+	int fps_max;
+	int fps_min;
+	int fps_idle;
+	int change_threshold;		/* 0 rescans every tile of every frame */
+	int rescan_interval;		/* frames */
+	int threshold;			/* THRESHOLD_FIXED, THRESHOLD_OTSU or THRESHOLD_PERCENTILE */
+	int threshold_percentile;
+	double threshold_smoothing;
+	int line_follow;		/* steer along the line instead of towards the sections */
+	double line_kp;
+	double line_ki;
+	double line_kd;
+	char calibration[256];		/* camera calibration file, empty for flat weights */
+	int debug_stream;		/* loopback port of the MJPEG stream, 0 for none */
+	int debug_fps;
+	char record[256];		/* directory recordings go to, empty for none */
+	int record_frames;
+	int record_buffers;
+	int self_aware;			/* run the controller, or only obey the REPL */
+	int realtime;
+	int io;				/* IO_THREADS, IO_EPOLL or IO_URING */
+	int rt_probe;
+	char metrics[108];		/* port or unix socket path, empty for none */
+	char camera[MAX_CAMERAS][64];	/* "<source>[@<cpu>]" specs */
+	int ncameras;
+	int camera_layer;		/* where the camera list came from, see config_set() */
+};
+typedef struct config_s config_t;
+
+#define IO_THREADS		0
+#define IO_EPOLL		1
+#define IO_URING		2
+
+#define THRESHOLD_FIXED		0	/* qualify-threshold, or what the REPL set */
+#define THRESHOLD_OTSU		1
+#define THRESHOLD_PERCENTILE	2
+
+static config_t config =
+{
+	.baud = DEFAULT_BAUD,
+	.telemetry_address = "00:02:72:16:1A:C1", /* This is the address of the dongle on my laptop */
+	.telemetry_psm = 0x1001,
+	.telemetry_interval = TELEMETRY_INTERVAL,
+	.sensor_deadline = SENSOR_DEADLINE,
+	.backup_distance = BACKUP_DISTANCE,
+	.avoid_distance = AVOID_DISTANCE,
+	.cruise_speed = CRUISE_SPEED,
+	.backup_time = BACKUP_TIME,
+	.dance_time = DANCE_TIME,
+	.color = COLOR_WHITE,
+	.qualify = QUALIFY_THRESHOLD,
+	.victory = VICTORY_THRESHOLD,
+	.direction = DIRECTION_THRESHOLD,
+	.camera_fov = CAMERA_FOV,
+	.steer_deadband = STEER_DEADBAND,
+	.steer_hard_angle = STEER_HARD_ANGLE,
+	.decision_smoothing = DECISION_SMOOTHING,
+	.decision_hysteresis = DECISION_HYSTERESIS,
+	.steer_publish_delta = STEER_PUBLISH_DELTA,
+	.fps_max = VISION_FPS_MAX,
+	.fps_min = VISION_FPS_MIN,
+	.fps_idle = VISION_FPS_IDLE,
+	.change_threshold = CHANGE_THRESHOLD,
+	.rescan_interval = RESCAN_INTERVAL,
+	.threshold = THRESHOLD_FIXED,
+	.threshold_percentile = THRESHOLD_PERCENT,
+	.threshold_smoothing = THRESHOLD_SMOOTHING,
+	.line_kp = LINE_KP,
+	.line_ki = LINE_KI,
+	.line_kd = LINE_KD,
+	.debug_fps = DEBUG_STREAM_FPS,
+	.record_frames = RECORD_FRAMES,
+	.record_buffers = RECORD_BUFFERS,
+	.self_aware = 1
+};
+static const config_t* const cfg = &config;
+
 struct pair_s
 {
 	uint8 id;
@@ -93,6 +521,7 @@ typedef pair_t turn_t;
 typedef pair_t move_t;
 typedef pair_t state_t;
 typedef pair_t command_t;
+typedef pair_t color_t;
 
 static turn_t turns[] =
 {
@@ -118,6 +547,15 @@ static state_t states[] =
 	{ STATE_UNKNOWN, "" }
 };
 
+static color_t colors[] =
+{
+	{ COLOR_BLUE, "blue" },
+	{ COLOR_GREEN, "green" },
+	{ COLOR_RED, "red" },
+	{ COLOR_WHITE, "white" },
+	{ COLOR_UNKNOWN, "" }
+};
+
 static command_t commands[] =
 {
 	{ CMD_TEENSY_MODE, "mode" },
@@ -131,6 +569,12 @@ static command_t commands[] =
 	{ CMD_SPEED, "speed" },
 	{ CMD_HELP, "help" },
 	{ CMD_QUIT, "quit" },
+	{ CMD_COLOR, "color" },
+	{ CMD_QUALIFY, "qualify-threshold" },
+	{ CMD_VICTORY, "victory-threshold" },
+	{ CMD_DIRECTION, "direction-threshold" },
+	{ CMD_VEHICLE, "vehicle" },
+	{ CMD_CALIBRATE, "calibrate" },
 	{ CMD_UNKNOWN, "" }
 };
 
@@ -213,573 +657,7068 @@ uint8 get_command_id(char* cmd_name)
 	return get_id_from_name(cmd_name, commands, NELEMENTS(commands));
 }
 
-uint8 get_decimal_value(char* decimal_str)
+char* get_color_name(uint8 color_id)
 {
-	uint8 decimal;
+	return get_name_from_id(color_id, colors, NELEMENTS(colors));
+}
 
-	if (decimal_str == NULL)
-		return 0;
+uint8 get_color_id(char* color_name)
+{
+	return get_id_from_name(color_name, colors, NELEMENTS(colors));
+}
 
-	decimal = (uint8) atoi(decimal_str);
+long timespec_diff_ms(struct timespec* end, struct timespec* start)
+{
+	return (end->tv_sec - start->tv_sec) * 1000 +
+		(end->tv_nsec - start->tv_nsec) / 1000000;
+}
 
-	return decimal;
+long timespec_diff_ns(struct timespec* end, struct timespec* start)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000L +
+		(end->tv_nsec - start->tv_nsec);
 }
 
-void send_command(int fd, uint8 cmd, uint8 val)
+long monotonic_ms()
 {
-	printf("sending command \"%s\" (0x%02X) with value %d (0x%02X)\n",
-		get_command_name(cmd), cmd, val, val);
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	write(fd, &cmd, 1);
-	write(fd, &val, 1);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
 
-void* IntelThreadProc(void* data)
+/* microseconds since main() started */
+long startup_us()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return timespec_diff_ns(&now, &start_time) / 1000;
+}
+
+/* prefixes log lines with the car they are about, once there is more than one */
+void print_vehicle(vehicle_t* vehicle)
+{
+	if (nvehicles > 1)
+		printf("car %d: ", vehicle->id);
+}
+
+/*
+	The Teensy never got the commands from the pair holding byte
+	offset on, so send_command_once() must not skip them next time.
+	Called with the vehicle's tty_mutex held.
+*/
+void tty_forget(vehicle_t* vehicle, uint8* commands, int offset, int length)
+{
+	int k;
+
+	for (k = offset & ~1; k + 1 < length; k += 2)
+		vehicle->last_sent[commands[k]] = 0;
+}
+
+/* called with the vehicle's tty_mutex held */
+void tty_write_queue(vehicle_t* vehicle)
 {
-	send_command(tty_fd, CMD_CHANGE_STATE, STATE_ORDERS);
+	struct pollfd pfd;
+	long deadline = 0;
+	long left;
+	int written = 0;
+	int n;
+
+	if (vehicle->tty_out_len == 0)
+		return;
 
-	while(1)
+	/* the tty is non-blocking, a full output buffer gets TTY_WRITE_TIMEOUT to drain */
+	while (written < vehicle->tty_out_len)
 	{
-		if(-1 == GLOBAL_WANTED_DIRECTION) 
+		io_syscalls++;
+		n = write(vehicle->tty_fd, vehicle->tty_out + written, vehicle->tty_out_len - written);
+
+		if (n > 0)
 		{
-			// VICTORY DANCE
-			send_command(tty_fd, CMD_CHANGE_STATE, STATE_DANCE);
-			sleep(10);
-			send_command(tty_fd, CMD_CHANGE_STATE, STATE_ORDERS);
+			METRIC_ADD(metrics.serial_writes, 1);
+			METRIC_ADD(metrics.serial_bytes_out, n);
+			written += n;
 		}
-		else if (35 > GLOBAL_SENSOR_CENTER)
-		{
-			// Do crazy backup
-			printf("do crazy backup\n");
-			send_command(tty_fd, CMD_SPEED, 0);
-			sleep(1);
-			send_command(tty_fd, CMD_SPEED, 127);
-			send_command(tty_fd, CMD_HARD_TURN, TURN_LEFT);
-			sleep(1);
-			send_command(tty_fd, CMD_HARD_TURN, TURN_NONE);
- 		} 
-		else if ((55 > GLOBAL_SENSOR_LEFT) || (3 == GLOBAL_WANTED_DIRECTION))
+		else if ((n < 0) && (errno == EINTR))
 		{
-			// SOFT TURN RIGHT
-			send_command(tty_fd, CMD_SOFT_TURN, TURN_RIGHT);
+			continue;
 		}
-		else if ((55 > GLOBAL_SENSOR_RIGHT) || (1 == GLOBAL_WANTED_DIRECTION))
+		else if ((n < 0) && (errno == EAGAIN))
 		{
-			// SOFT TURN LEFT
-			send_command(tty_fd, CMD_SOFT_TURN, TURN_LEFT);
+			pfd.fd = vehicle->tty_fd;
+			pfd.events = POLLOUT;
+
+			/* one deadline for the whole queue, poll() may say writable while write() still can't */
+			if (deadline == 0)
+				deadline = monotonic_ms() + TTY_WRITE_TIMEOUT;
+
+			left = deadline - monotonic_ms();
+
+			if ((left <= 0) || (poll(&pfd, 1, left) <= 0))
+			{
+				fprintf(stderr, "write: tty stalled, %d bytes lost\n", vehicle->tty_out_len - written);
+				break;
+			}
 		}
 		else
 		{
-			send_command(tty_fd, CMD_HARD_TURN, TURN_NONE);
-			send_command(tty_fd, CMD_SPEED, 127);
-			send_command(tty_fd, CMD_SET_DIRECTION, MOVE_FORWARD);
+			perror("write");
+			break;
 		}
-
-		sleep(1);
 	}
+
+	tty_forget(vehicle, vehicle->tty_out, written, vehicle->tty_out_len);
+	vehicle->tty_out_len = 0;
 }
 
-void* BTThreadProc(void* data)
+void tty_begin_batch(vehicle_t* vehicle)
 {
-  struct sockaddr_l2 addr = { 0 };
-  int s, status;
-  char buffer[100];
-  char dest[18] = "00:02:72:16:1A:C1"; /* This is the address of the dongle on my laptop */
-  char sendbuffer[100] = { 0 }; 
-
-  while(1)
-  {
-    sleep(1);
-    // allocate a socket
-    s = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
-
-    // set the connection parameters (who to connect to)
-    addr.l2_family = AF_BLUETOOTH;
-    addr.l2_psm = htobs(0x1001);
-    str2ba( dest, &addr.l2_bdaddr );
-
-    // connect to server
-    status = connect(s, (struct sockaddr *)&addr, sizeof(addr));
+	pthread_mutex_lock(&vehicle->tty_mutex);
+	vehicle->tty_batch++;
+}
 
-    // send a message
-    if (status == 0) 
-    {
-        memset(sendbuffer, 0, sizeof(sendbuffer));
-        strcpy(sendbuffer, "mode: "); 
-        sprintf(buffer, "%i", GLOBAL_MODE); 
-        strcat(sendbuffer, buffer); 
-        strcat(sendbuffer, ", ");
-
-        strcat(sendbuffer, get_state_name(GLOBAL_MODE));
-
-        strcat(sendbuffer, "\n"); 
-
-        strcat(sendbuffer, "speed: "); 
-        sprintf(buffer, "%i", GLOBAL_SPEED);
-        strcat(sendbuffer, buffer); 
-        strcat(sendbuffer, "\n"); 
-
-                    strcat(sendbuffer, "distance.right: "); 
-        if (GLOBAL_SENSOR_RIGHT < 0xFF)  
-        {
-          sprintf(buffer, "%i", GLOBAL_SENSOR_RIGHT);
-          strcat(sendbuffer, buffer); 
-        }
-        else 
-          strcat(sendbuffer, "Far, far, away..."); 
-        
-        strcat(sendbuffer, "\n"); 
- 
-                    strcat(sendbuffer, "distance.center: "); 
-        if (GLOBAL_SENSOR_CENTER < 0xFF)  
-        {
-          sprintf(buffer, "%i", GLOBAL_SENSOR_CENTER);
-          strcat(sendbuffer, buffer); 
-        }
-        else 
-          strcat(sendbuffer, "Far, far, away..."); 
-        strcat(sendbuffer, "\n");                    
-
-                    strcat(sendbuffer, "distance.right: "); 
-        if (GLOBAL_SENSOR_LEFT < 0xFF)  
-        {
-          sprintf(buffer, "%i", GLOBAL_SENSOR_LEFT);
-          strcat(sendbuffer, buffer); 
-        }
-        else 
-          strcat(sendbuffer, "Far, far, away..."); 
+void tty_end_batch(vehicle_t* vehicle)
+{
+	vehicle->tty_batch--;
 
-        strcat(sendbuffer, "\n"); 
-        status = write(s, sendbuffer, sizeof(sendbuffer)); 
-    }
+	if ((vehicle->tty_batch == 0) && !tty_deferred)
+		tty_write_queue(vehicle);
 
-    if( status < 0 ) perror("DERP!");
-  }
+	pthread_mutex_unlock(&vehicle->tty_mutex);
 }
 
-/* opencv stuff goes here */
-void* CameraThreadProc(void* tdata)
+void send_command(vehicle_t* vehicle, uint8 cmd, uint8 val)
 {
-    CvCapture *capture = 0;
-    IplImage *frame = 0;
-    int key = 0;
-    int loop; 
-    
-    int arg_index; 
-
-    /* Mainly for loops */
-    int i;
-    int j;
-    int k;
-    unsigned char screen_section; 
-    unsigned int screen_segment; 
-
-    int step; 
-    int height;
-    int width; 
-    int channels;
-    
-    unsigned long count_red; 
+	long unset;
+	long now_us;
 
-    /* 
-      Depending on these percentages, and the defined threshold,
-      we will know and tell the vehicle appropriately which way to
-      go. 
-    */
-    unsigned int total_section1 = 0;
-    unsigned int total_section2 = 0;
-    unsigned int total_section3 = 0;
-    double percent_r_section1 = 0.0f; 
-    double percent_r_section2 = 0.0f; 
-    double percent_r_section3 = 0.0f; 
-    char direction[10];
-    
-    /* Controls what color we're looking for */
-    unsigned char channel_checking = 0; 
+	if (!quiet)
+	{
+		print_vehicle(vehicle);
+		printf("sending command \"%s\" (0x%02X) with value %d (0x%02X)\n",
+			get_command_name(cmd), cmd, val, val);
+	}
 
-    unsigned char *data; 
- 
-    channel_checking = 2; // red
+	METRIC_ADD(metrics.commands_sent, 1);
 
-#if 0
-    for (arg_index=0; arg_index<argc; ++arg_index)
-    {
-      if (!strcmp(argv[arg_index],"--color=blue"))
-      {
-        channel_checking = 0; 
-        printf("Detecting blue\n");
-      }
-      if (!strcmp(argv[arg_index],"--color=green")) 
-      {
-        channel_checking = 1; 
-        printf("Detecting green\n");
-      }
-      if (!strcmp(argv[arg_index],"--color=red")) 
-      {
-        channel_checking = 2; 
-        printf("Detecting red\n");
-      }
-    }
-#endif 
+	pthread_mutex_lock(&vehicle->tty_mutex);
 
-    /* initialize camera */
-    capture = cvCaptureFromCAM( 0 );
- 
-    /* always check */
-    if ( !capture ) {
-        fprintf( stderr, "Cannot open initialize webcam!\n" );
-        return 1;
-    }
- 
-    /* create a window for the video */
-    // cvNamedWindow( "result", CV_WINDOW_AUTOSIZE );
- 
-    while( key != 'q' ) {
-        /* get a frame */
-        frame = cvQueryFrame( capture );
+	if (vehicle->tty_out_len + 2 > sizeof(vehicle->tty_out))
+		tty_write_queue(vehicle);
 
-        /* always check */
-        if( !frame ) break;
-       
-        data = (unsigned char*) frame->imageData; 
+	vehicle->tty_out[vehicle->tty_out_len++] = cmd;
+	vehicle->tty_out[vehicle->tty_out_len++] = val;
 
-        height = frame->height; 
-        width = frame->width; 
-        step = frame->widthStep;
-        channels = frame->nChannels;
-
-        screen_segment = width / 3; 
-
-        count_red = 0 ;
-        total_section1 = 0;       
-        total_section2 = 0;       
-        total_section3 = 0;       
-        
-        for(i=0;i<height;i++) 
-        {
-          for(j=0;j<width;j++) 
-          {
-            
-            /* Check if white */
-            if (data[i*step+j*channels+2] >= QUALIFY_THRESHOLD &&
-                data[i*step+j*channels+0] >= QUALIFY_THRESHOLD && 
-                data[i*step+j*channels+1] >= QUALIFY_THRESHOLD   ) 
-            {
-              ++count_red;
-
-              /* Right Segment */
-              if (j>=screen_segment*2)
-              {
-                ++total_section3;
-              }
-              /* Middle Segment */
-              else if (j>=screen_segment)
-              {
-                ++total_section2; 
-              }
-              /* Left Segment */
-              else 
-              {
-                ++total_section1; 
-              }
-  
-            }
-
-          } 
-        }
+	/* before the write, which forgets it again when it does not make it out */
+	vehicle->last_sent[cmd] = val + 1;
 
-        // printf("countred: %d\n", count_red);
+	if (cmd == CMD_SPEED)
+		vehicle->speed = val;
+	else if (cmd == CMD_CHANGE_STATE)
+		vehicle->state = val;
 
-        percent_r_section1 = 100 * (double) total_section1 / (screen_segment * height); 
-        percent_r_section2 = 100 * (double) total_section2 / (screen_segment * height); 
-        percent_r_section3 = 100 * (double) total_section3 / (screen_segment * height); 
+	/* both turn commands drive the same steering, so one replaces the other */
+	if (cmd == CMD_HARD_TURN)
+		vehicle->last_sent[CMD_SOFT_TURN] = 0;
+	else if (cmd == CMD_SOFT_TURN)
+		vehicle->last_sent[CMD_HARD_TURN] = 0;
 
-#ifdef DEBUGMODE
+	if ((vehicle->tty_batch == 0) && !tty_deferred)
+		tty_write_queue(vehicle);
 
-        /*
-            Note - This is your intelligence!
-            Watch it crumble! When adding to the
-            beagle board, you should just set
-            the global flag here so that the thread
-            edits said variable. 
-        */
+	/* each car holds only its own tty_mutex, the first of them to get here wins */
+	if (__atomic_load_n(&first_command_us, __ATOMIC_RELAXED) < 0)
+	{
+		unset = -1;
+		now_us = startup_us();
 
-        /* left case */ 
-        if( percent_r_section1 >= VICTORY_THRESHOLD )
-        {
-          strcpy(direction,"[victory]");      
-          GLOBAL_WANTED_DIRECTION = -1; 
-        }
-        else if 
-        ( percent_r_section3 > percent_r_section2 && 
-          percent_r_section3 > percent_r_section1 && 
-          percent_r_section3 >= DIRECTION_THRESHOLD) 
-        {
-          strcpy(direction,"[left]");      
-          GLOBAL_WANTED_DIRECTION = 1; 
-        }
+		if (__atomic_compare_exchange_n(&first_command_us, &unset, now_us, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			printf("first command after %.1f ms\n", now_us / 1000.0);
+	}
 
-        /* right case */
-        else if 
-        ( percent_r_section1 > percent_r_section2 && 
-          percent_r_section1 > percent_r_section3 && 
-          percent_r_section1 >= DIRECTION_THRESHOLD)
-        {
-          strcpy(direction,"[right]");      
-          GLOBAL_WANTED_DIRECTION = 1; 
-        }
+	pthread_mutex_unlock(&vehicle->tty_mutex);
+}
 
-        /* forward case */
-        else if 
-        ( percent_r_section2 > percent_r_section1 &&
-          percent_r_section2 > percent_r_section3 && 
-          percent_r_section2 >= DIRECTION_THRESHOLD)
-        {
-          strcpy(direction,"[forward]");      
-          GLOBAL_WANTED_DIRECTION = 2; 
-        }
+/* same as send_command, but skips values the Teensy already has */
+void send_command_once(vehicle_t* vehicle, uint8 cmd, uint8 val)
+{
+	int sent;
 
-        /* default */
-        else 
-        {
-          strcpy(direction,"[default]");      
-	  GLOBAL_WANTED_DIRECTION = -2; 
-        }
+	pthread_mutex_lock(&vehicle->tty_mutex);
+	sent = vehicle->last_sent[cmd];
+	pthread_mutex_unlock(&vehicle->tty_mutex);
 
-        /*printf
-        (
-          "x:%d,y:%d,[r%%:%f][r%%:%f][r%%:%f] : I want to go... %s    ", 
-          frame->width
-          ,frame->height
-          ,percent_r_section1 
-          ,percent_r_section2 
-          ,percent_r_section3 
-          ,direction
-        );*/
+	if (sent != val + 1)
+		send_command(vehicle, cmd, val);
+}
 
-        for(loop=0; loop<1000; ++loop)
-          printf("\b"); 
+/* makes the vehicle's controller run now, called with decision_mutex held */
+void wake_controller(vehicle_t* vehicle)
+{
+	vehicle->decision_seq++;
+	pthread_cond_broadcast(&decision_cond);
 
-#endif 
-        /* display current frame - have disabled when using beagle */
-        // cvShowImage( "result", frame );
- 
-        /* exit if user press 'q' */
-        key = cvWaitKey( 1 );
-    }
- 
-    /* free memory */
-    // cvDestroyWindow( "result" );
-    cvReleaseCapture( &capture );
- 
+	if (decision_event_fd >= 0)
+		eventfd_write(decision_event_fd, 1);
 }
 
-void* CmdThreadProc(void* data)
+void publish_decision(camera_t* camera, int direction, int steering)
 {
-	char* p;
-	uint8 state;
-	uint8 val = 0;
-	uint8 cmd = 0;
-	char* cmd_str;
-	char* val_str;
-	char input[128];
+	vehicle_t* vehicle = camera->vehicle;
+	int k;
 
-	while (1)
-	{
-		printf("cmd: ");
-		scanf("%s", input);
+	pthread_mutex_lock(&decision_mutex);
 
-		p = strchr(input, ':');
-		val_str = cmd_str = NULL;
-
-		if (p != NULL)
-		{
-			val_str = p + 1;
-			input[(p - input)] = '\0';
-		}
+	camera->direction = direction;
+	camera->steering = steering;
 
-		cmd_str = input;
+	/* any camera can see the goal, otherwise the first one with an opinion steers */
+	direction = -2;
+	steering = 0;
 
-		cmd = get_command_id(cmd_str);
+	for (k = 0; k < ncameras; k++)
+	{
+		if (cameras[k].vehicle != vehicle)
+			continue;
 
-		if (cmd == CMD_UNKNOWN)
+		if (cameras[k].direction == -1)
 		{
-			printf("unknown command!\n");
-			continue;
+			direction = -1;
+			steering = 0;
+			break;
 		}
 
-		switch (cmd)
+		if ((direction < 0) && (cameras[k].direction > 0))
 		{
-			case CMD_TEENSY_MODE:
-				state = get_state_id(val_str);
+			direction = cameras[k].direction;
+			steering = cameras[k].steering;
+		}
+	}
 
-				if (state == STATE_UNKNOWN)
-				{
-					printf("unknown mode!\n");
-					continue;
-				}
+	if ((direction != vehicle->wanted_direction) ||
+		(abs(steering - vehicle->wanted_steering) >= cfg->steer_publish_delta))
+	{
+		vehicle->wanted_direction = direction;
+		vehicle->wanted_steering = steering;
+		wake_controller(vehicle);
+	}
 
-				send_command(tty_fd, cmd, state);
-				break;
+	pthread_mutex_unlock(&decision_mutex);
+}
 
-			case CMD_CHANGE_STATE:
-				state = get_state_id(val_str);
+/*
+	Hands the line a camera sees to its car's controller, every frame:
+	the loop runs at camera rate. A camera that lost the line, or
+	stopped (line NULL), only takes it away when it was the one that
+	saw it.
+*/
+void publish_line(camera_t* camera, line_t* line)
+{
+	vehicle_t* vehicle = camera->vehicle;
 
-				if (state == STATE_UNKNOWN)
-				{
-					printf("unknown state!\n");
-					continue;
-				}
+	pthread_mutex_lock(&decision_mutex);
 
-				send_command(tty_fd, cmd, state);
-				break;
+	if ((line != NULL) && (line->valid || !vehicle->line.valid || (vehicle->line.camera == camera->id)))
+	{
+		vehicle->line = *line;
+		vehicle->line.camera = camera->id;
+		wake_controller(vehicle);
+	}
+	else if ((line == NULL) && (vehicle->line.camera == camera->id))
+	{
+		vehicle->line.valid = 0;
+		wake_controller(vehicle);
+	}
 
-			case CMD_HARD_TURN:
-				val = get_turn_id(val_str);
+	pthread_mutex_unlock(&decision_mutex);
+}
 
-				if (val == TURN_UNKNOWN)
-				{
-					printf("unknown turn!\n");
-					continue;
-				}
+/* blocks until the vehicle has a new decision or the timeout expires */
+void wait_for_decision(vehicle_t* vehicle, long timeout_ms)
+{
+	struct timespec deadline;
+	unsigned long seq;
+	int status = 0;
 
-				send_command(tty_fd, cmd, val);
-				break;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
 
-			case CMD_SOFT_TURN:
-				val = get_turn_id(val_str);
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
 
-				if (val == TURN_UNKNOWN)
-				{
-					printf("unknown turn!\n");
-					continue;
-				}
+	pthread_mutex_lock(&decision_mutex);
+	seq = vehicle->decision_seq;
 
-				send_command(tty_fd, cmd, val);
-				break;
+	while ((seq == vehicle->decision_seq) && (status != ETIMEDOUT) && !stop_requested)
+		status = pthread_cond_timedwait(&decision_cond, &decision_mutex, &deadline);
 
-			case CMD_SET_DIRECTION:
-				val = get_move_id(val_str);
+	pthread_mutex_unlock(&decision_mutex);
+}
 
-				if (val == MOVE_UNKNOWN)
-				{
-					printf("unknown move direction!\n");
-					continue;
-				}
+void request_stop()
+{
+	if (__atomic_exchange_n(&stop_requested, 1, __ATOMIC_SEQ_CST))
+		return;
 
-				send_command(tty_fd, cmd, val);
-				break;
+	clock_gettime(CLOCK_MONOTONIC, &stop_time);
+	eventfd_write(stop_fd, 1);
 
-			case CMD_DIST_CENTER:
-				val = get_decimal_value(val_str);
-				send_command(tty_fd, cmd, val);
-				break;
+	/* wakes the controllers out of wait_for_decision() */
+	pthread_mutex_lock(&decision_mutex);
+	pthread_cond_broadcast(&decision_cond);
+	pthread_mutex_unlock(&decision_mutex);
+}
 
-			case CMD_DIST_LEFT:
-				val = get_decimal_value(val_str);
-				send_command(tty_fd, cmd, val);
-				break;
+/*
+	Waits up to timeout_ms (-1 for ever) for fd to become ready for
+	events, or for a stop request. Returns 1 when stopping, 0 otherwise.
+*/
+int stop_wait(int fd, short events, int timeout_ms)
+{
+	struct pollfd pfd[2];
 
-			case CMD_DIST_RIGHT:
-				val = get_decimal_value(val_str);
-				send_command(tty_fd, cmd, val);
-				break;
+	pfd[0].fd = stop_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = fd;
+	pfd[1].events = events;
 
-			case CMD_SPEED:
-				val = get_decimal_value(val_str);
-				send_command(tty_fd, cmd, val);
-				break;
+	poll(pfd, (fd >= 0) ? 2 : 1, timeout_ms);
 
-			case CMD_HELP:
-				val = get_command_id(val_str);
+	return stop_requested;
+}
 
-				if (val == CMD_UNKNOWN)
-				{
-					printf("command syntax: <command>:<value>\n");
-					print_command_list();
-				}
-				else
-				{
-					switch (val)
-					{
-						case CMD_CHANGE_STATE:
-							printf("state:<state>, where <state> is one of the following:\n");
-							printf("nothing, basic, orders, dance.\n");
-							break;
+void steer_from_angle(vehicle_t* vehicle, int angle)
+{
+	uint8 turn;
+	int magnitude = abs(angle);
+
+	/* mass right of centre asks for a left turn, as in the decision table */
+	turn = (angle > 0) ? TURN_LEFT : TURN_RIGHT;
+
+	if (magnitude < cfg->steer_deadband)
+		send_command_once(vehicle, CMD_HARD_TURN, TURN_NONE);
+	else if (magnitude < cfg->steer_hard_angle)
+		send_command_once(vehicle, CMD_SOFT_TURN, turn);
+	else
+		send_command_once(vehicle, CMD_HARD_TURN, turn);
+
+	/* slow down in proportion to how hard we are turning */
+	if (magnitude > cfg->camera_fov / 2)
+		magnitude = cfg->camera_fov / 2;
+
+	send_command_once(vehicle, CMD_SPEED, cfg->cruise_speed -
+		(((cfg->cruise_speed + 1) / 2) * magnitude) / (cfg->camera_fov / 2));
+	send_command_once(vehicle, CMD_SET_DIRECTION, MOVE_FORWARD);
+}
 
-						default:
-							printf("command syntax: <command>:<value>\n");
-							print_command_list();
-							break;
-					}
-				}
+/*
+	The Teensy knows three steering positions a side: straight, soft
+	and hard. A graded angle becomes a duty cycle between them, sent at
+	camera rate by error diffusion, so that the positions of the last
+	few frames average to the angle: half of steer-hard-angle alternates
+	straight and soft, 1.5 times it soft and hard. The speed is graded
+	as in steer_from_angle().
+*/
+void steer_graded(vehicle_t* vehicle, double angle, double* dither)
+{
+	double magnitude = fabs(angle);
+	double level = 0;
+	uint8 turn;
+	int position;
+
+	/* mass right of centre asks for a left turn, as in the decision table */
+	turn = (angle > 0) ? TURN_LEFT : TURN_RIGHT;
+
+	if (magnitude >= cfg->steer_deadband)
+		level = MIN(magnitude / cfg->steer_hard_angle, 2.0);
+
+	*dither += level;
+	position = MIN(MAX((int) floor(*dither + 0.5), 0), 2);
+	*dither -= position;
+
+	if (position == 0)
+		send_command_once(vehicle, CMD_HARD_TURN, TURN_NONE);
+	else if (position == 1)
+		send_command_once(vehicle, CMD_SOFT_TURN, turn);
+	else
+		send_command_once(vehicle, CMD_HARD_TURN, turn);
+
+	magnitude = MIN(magnitude, cfg->camera_fov / 2.0);
+
+	send_command_once(vehicle, CMD_SPEED, (uint8) lround(cfg->cruise_speed -
+		((cfg->cruise_speed + 1) / 2) * magnitude / (cfg->camera_fov / 2.0)));
+	send_command_once(vehicle, CMD_SET_DIRECTION, MOVE_FORWARD);
+}
+
+/* copies the line to follow, 0 when there is none fresh enough, which restarts the PID loop */
+int line_current(vehicle_t* vehicle, line_t* line)
+{
+	struct timespec now;
+
+	pthread_mutex_lock(&decision_mutex);
+	*line = vehicle->line;
+	pthread_mutex_unlock(&decision_mutex);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (line->valid && (timespec_diff_ms(&now, &line->captured) <= LINE_DEADLINE))
+		return 1;
+
+	vehicle->line_pid.primed = 0;
+
+	return 0;
+}
+
+/* one PID step on the bearing error of a new line, the steering holds until the next one */
+void line_steer(vehicle_t* vehicle, line_t* line)
+{
+	line_pid_t* pid = &vehicle->line_pid;
+	double derivative = 0;
+	double limit;
+	double output;
+	double dt;
+
+	/* after a gap, say an obstacle to avoid, the loop starts over */
+	if (!pid->primed || (timespec_diff_ms(&line->captured, &pid->last) > LINE_DEADLINE))
+	{
+		pid->integral = 0;
+		pid->dither = 0;
+		dt = 0;
+	}
+	else
+	{
+		dt = timespec_diff_ns(&line->captured, &pid->last) / 1e9;
+
+		/* woken by something else than a frame */
+		if (dt <= 0)
+			return;
+
+		derivative = (line->error - pid->last_error) / dt;
+	}
+
+	/* no windup beyond what a full hard turn needs */
+	pid->integral += line->error * dt;
+
+	if (cfg->line_ki > 0)
+	{
+		limit = 2.0 * cfg->steer_hard_angle / cfg->line_ki;
+		pid->integral = MIN(MAX(pid->integral, -limit), limit);
+	}
+
+	output = cfg->line_kp * line->error + cfg->line_ki * pid->integral + cfg->line_kd * derivative;
+
+	pid->primed = 1;
+	pid->last = line->captured;
+	pid->last_error = line->error;
+
+	steer_graded(vehicle, output, &pid->dither);
+}
+
+/* enters a phase that lasts for ms milliseconds */
+long intel_wait(vehicle_t* vehicle, int phase, long ms)
+{
+	struct timespec* until = &vehicle->intel_until;
+
+	clock_gettime(CLOCK_MONOTONIC, until);
+	until->tv_sec += ms / 1000;
+	until->tv_nsec += (ms % 1000) * 1000000L;
+
+	if (until->tv_nsec >= 1000000000L)
+	{
+		until->tv_sec++;
+		until->tv_nsec -= 1000000000L;
+	}
+
+	vehicle->intel_phase = phase;
+
+	return ms;
+}
+
+/*
+	Runs the controller once and returns how many milliseconds it wants
+	to wait before the next step. The dance and the crazy backup are
+	phases with a deadline instead of sleeps, so that both the thread
+	and the event loop can drive the controller without blocking.
+*/
+long intel_step(vehicle_t* vehicle)
+{
+	struct timespec now;
+	line_t line;
+	long remaining;
+
+	/*
+		The watchdog already stopped the car. Abort whatever phase was
+		running and keep the Teensy taking orders at speed 0 until the
+		sensors are fresh again; the watchdog wakes us when they are.
+	*/
+	if (__atomic_load_n(&vehicle->sensor_stale, __ATOMIC_ACQUIRE))
+	{
+		if (vehicle->state != STATE_ORDERS)
+			send_command(vehicle, CMD_CHANGE_STATE, STATE_ORDERS);
+
+		send_command_once(vehicle, CMD_SPEED, 0);
+		vehicle->intel_phase = INTEL_DRIVE;
+
+		return 1000;
+	}
+
+	if ((vehicle->intel_phase != INTEL_START) && (vehicle->intel_phase != INTEL_DRIVE))
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		remaining = timespec_diff_ms(&vehicle->intel_until, &now);
+
+		if (remaining > 0)
+			return remaining;
+	}
+
+	switch (vehicle->intel_phase)
+	{
+		case INTEL_START:
+			send_command(vehicle, CMD_CHANGE_STATE, STATE_ORDERS);
+			vehicle->intel_phase = INTEL_DRIVE;
+			break;
+
+		case INTEL_DANCE:
+			send_command(vehicle, CMD_CHANGE_STATE, STATE_ORDERS);
+			return intel_wait(vehicle, INTEL_DRIVE, 1000);
+
+		case INTEL_BACKUP_STOP:
+			send_command(vehicle, CMD_SPEED, cfg->cruise_speed);
+			send_command(vehicle, CMD_HARD_TURN, TURN_LEFT);
+			return intel_wait(vehicle, INTEL_BACKUP_TURN, cfg->backup_time);
+
+		case INTEL_BACKUP_TURN:
+			send_command(vehicle, CMD_HARD_TURN, TURN_NONE);
+			return intel_wait(vehicle, INTEL_DRIVE, cfg->backup_time);
+	}
+
+	if(-1 == vehicle->wanted_direction) 
+	{
+		// VICTORY DANCE
+		send_command(vehicle, CMD_CHANGE_STATE, STATE_DANCE);
+		return intel_wait(vehicle, INTEL_DANCE, cfg->dance_time);
+	}
+	else if (cfg->backup_distance > vehicle->sensor[SENSOR_CENTER])
+	{
+		// Do crazy backup
+		print_vehicle(vehicle);
+		printf("do crazy backup\n");
+		send_command(vehicle, CMD_SPEED, 0);
+		return intel_wait(vehicle, INTEL_BACKUP_STOP, cfg->backup_time);
+	} 
+	else if (cfg->avoid_distance > vehicle->sensor[SENSOR_LEFT])
+	{
+		// SOFT TURN RIGHT
+		send_command_once(vehicle, CMD_SOFT_TURN, TURN_RIGHT);
+	}
+	else if (cfg->avoid_distance > vehicle->sensor[SENSOR_RIGHT])
+	{
+		// SOFT TURN LEFT
+		send_command_once(vehicle, CMD_SOFT_TURN, TURN_LEFT);
+	}
+	else if (cfg->line_follow && line_current(vehicle, &line))
+	{
+		// FOLLOW THE LINE, the camera wakes us every frame
+		line_steer(vehicle, &line);
+
+		return LINE_DEADLINE;
+	}
+	else if (vehicle->wanted_direction > 0)
+	{
+		// STEER TOWARDS THE CENTROID
+		steer_from_angle(vehicle, vehicle->wanted_steering);
+	}
+	else
+	{
+		send_command_once(vehicle, CMD_HARD_TURN, TURN_NONE);
+		send_command_once(vehicle, CMD_SPEED, cfg->cruise_speed);
+		send_command_once(vehicle, CMD_SET_DIRECTION, MOVE_FORWARD);
+	}
+
+	/* sensors are polled once a second, vision wakes us right away */
+	return 1000;
+}
+
+/* one controller step, with its commands leaving in a single write */
+long intel_run(vehicle_t* vehicle)
+{
+	long delay;
+
+	/* without --self-aware-mode only the REPL drives */
+	if (!cfg->self_aware)
+		return 1000;
+
+	tty_begin_batch(vehicle);
+	delay = intel_step(vehicle);
+	tty_end_batch(vehicle);
+
+	return delay;
+}
+
+void* IntelThreadProc(void* data)
+{
+	vehicle_t* vehicle = (vehicle_t*) data;
+
+	while(!stop_requested)
+	{
+		wait_for_decision(vehicle, intel_run(vehicle));
+	}
+
+	return NULL;
+}
+
+/*
+	Checks the age of the distance readings. Going stale stops the car
+	right here, without waiting for the controller's next step. Returns
+	1 when the state changed and the controller should run now.
+*/
+int watchdog_check(vehicle_t* vehicle)
+{
+	long now = monotonic_ms();
+	long oldest = now;
+	long stamp;
+	int stale;
+	int k;
+
+	for (k = 0; k < NELEMENTS(vehicle->sensor_stamp); k++)
+	{
+		stamp = __atomic_load_n(&vehicle->sensor_stamp[k], __ATOMIC_ACQUIRE);
+
+		if (stamp < oldest)
+			oldest = stamp;
+	}
+
+	stale = (now - oldest) > cfg->sensor_deadline;
+
+	if (stale == vehicle->sensor_stale)
+		return 0;
+
+	__atomic_store_n(&vehicle->sensor_stale, stale, __ATOMIC_RELEASE);
+
+	if (stale)
+	{
+		if (!quiet)
+		{
+			print_vehicle(vehicle);
+			printf("sensors silent for %ld ms, stopping\n", now - oldest);
+		}
+
+		send_command(vehicle, CMD_SPEED, 0);
+	}
+	else if (!quiet)
+	{
+		print_vehicle(vehicle);
+		printf("sensors back, resuming\n");
+	}
+
+	return 1;
+}
+
+/* one watchdog checks every vehicle */
+void* WatchdogThreadProc(void* data)
+{
+	int k;
+
+	while (!stop_wait(-1, 0, WATCHDOG_PERIOD))
+	{
+		for (k = 0; k < nvehicles; k++)
+		{
+			if (!watchdog_check(&vehicles[k]))
+				continue;
+
+			/* same wakeup as a new decision */
+			pthread_mutex_lock(&decision_mutex);
+			wake_controller(&vehicles[k]);
+			pthread_mutex_unlock(&decision_mutex);
+		}
+	}
+
+	return NULL;
+}
+
+/* formats the status report of one vehicle for the telemetry dongle */
+int format_telemetry(vehicle_t* vehicle, char* buffer, int size)
+{
+	char right[8];
+	char center[8];
+	char left[8];
+	char far[] = "Far, far, away...";
+	int* sensor = vehicle->sensor;
+	int len = 0;
+
+	snprintf(right, sizeof(right), "%i", sensor[SENSOR_RIGHT]);
+	snprintf(center, sizeof(center), "%i", sensor[SENSOR_CENTER]);
+	snprintf(left, sizeof(left), "%i", sensor[SENSOR_LEFT]);
+
+	/* single car reports keep their old format */
+	if (nvehicles > 1)
+		len = snprintf(buffer, size, "car: %i\n", vehicle->id);
+
+	return len + snprintf(buffer + len, size - len,
+		"mode: %i, %s\n"
+		"speed: %i\n"
+		"distance.right: %s\n"
+		"distance.center: %s\n"
+		"distance.left: %s\n",
+		vehicle->mode, get_state_name(vehicle->mode),
+		vehicle->speed,
+		(sensor[SENSOR_RIGHT] < 0xFF) ? right : far,
+		(sensor[SENSOR_CENTER] < 0xFF) ? center : far,
+		(sensor[SENSOR_LEFT] < 0xFF) ? left : far);
+}
+
+void telemetry_address(struct sockaddr_l2* addr)
+{
+	memset(addr, 0, sizeof(struct sockaddr_l2));
+	addr->l2_family = AF_BLUETOOTH;
+	addr->l2_psm = htobs(cfg->telemetry_psm);
+	str2ba(cfg->telemetry_address, &addr->l2_bdaddr);
+}
+
+void* BTThreadProc(void* data)
+{
+  struct sockaddr_l2 addr;
+  int s, k, status, error;
+  socklen_t error_len;
+  char sendbuffer[256];
+
+  telemetry_address(&addr);
+
+  while(!stop_wait(-1, 0, cfg->telemetry_interval))
+  {
+    // allocate a socket
+    s = socket(AF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK, BTPROTO_L2CAP);
+
+    if (s < 0)
+    {
+      perror("DERP!");
+      METRIC_ADD(metrics.telemetry_failed, 1);
+      continue;
+    }
+
+    // connect to server, giving up if we are asked to stop meanwhile
+    status = connect(s, (struct sockaddr *)&addr, sizeof(addr));
+
+    if ((status < 0) && (errno == EINPROGRESS))
+    {
+      if (stop_wait(s, POLLOUT, -1))
+      {
+        close(s);
+        break;
+      }
+
+      error = 0;
+      error_len = sizeof(error);
+      getsockopt(s, SOL_SOCKET, SO_ERROR, &error, &error_len);
+      status = error ? -1 : 0;
+      errno = error;
+    }
+
+    // send a message per car
+    for (k = 0; (status == 0) && (k < nvehicles); k++)
+    {
+        status = write(s, sendbuffer, format_telemetry(&vehicles[k], sendbuffer, sizeof(sendbuffer)));
+    }
+
+    if( status < 0 ) perror("DERP!");
+
+    if (status < 0)
+      METRIC_ADD(metrics.telemetry_failed, 1);
+    else
+      METRIC_ADD(metrics.telemetry_sent, 1);
+
+    close(s);
+  }
+
+  return NULL;
+}
+
+/* opencv stuff goes here */
+
+/*
+	Vision parameters that can be changed while running. Writers
+	serialise on a mutex and bump the sequence number around their
+	update, the camera thread copies the whole set once per frame and
+	retries if it raced with a writer, so the hot path never blocks.
+*/
+struct vision_params_s
+{
+	int color;
+	int qualify;	/* minimum channel value for a pixel to qualify */
+	int victory;	/* percent of the left section one blob must cover to declare victory */
+	int direction;	/* percent of a section needed to steer towards it */
+};
+typedef struct vision_params_s vision_params_t;
+
+static vision_params_t vision_params =
+{
+	COLOR_WHITE,
+	QUALIFY_THRESHOLD,
+	VICTORY_THRESHOLD,
+	DIRECTION_THRESHOLD
+};
+static unsigned int vision_params_seq = 0;
+static pthread_mutex_t vision_params_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void vision_params_get(vision_params_t* params)
+{
+	unsigned int seq;
+
+	do
+	{
+		seq = __atomic_load_n(&vision_params_seq, __ATOMIC_ACQUIRE);
+
+		params->color = __atomic_load_n(&vision_params.color, __ATOMIC_RELAXED);
+		params->qualify = __atomic_load_n(&vision_params.qualify, __ATOMIC_RELAXED);
+		params->victory = __atomic_load_n(&vision_params.victory, __ATOMIC_RELAXED);
+		params->direction = __atomic_load_n(&vision_params.direction, __ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}
+	while ((seq & 1) || (seq != __atomic_load_n(&vision_params_seq, __ATOMIC_RELAXED)));
+}
+
+/* offset is the offsetof() a field in vision_params_t */
+void vision_params_set(size_t offset, int value)
+{
+	int* field = (int*) ((char*) &vision_params + offset);
+
+	pthread_mutex_lock(&vision_params_mutex);
+
+	__atomic_store_n(&vision_params_seq, vision_params_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(field, value, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&vision_params_seq, vision_params_seq + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&vision_params_mutex);
+}
+
+/*
+	Streaming connected-component labeller. The pixels of one class are
+	fed as horizontal runs, row by row, and each row is joined to the
+	one above through the runs that touch it (8-connected). Only two
+	rows of runs and the labels they use are kept, so memory is bounded
+	by the frame width; a blob is reported as soon as a row no longer
+	continues it, and only the BLOB_MAX largest of a frame are kept.
+*/
+#define BLOB_MAX		16
+
+struct blob_s
+{
+	int x0;			/* bounding box, inclusive */
+	int y0;
+	int x1;
+	int y1;
+	unsigned long area;
+	unsigned long floor_area;	/* area weighted by the floor each row covers */
+	double cx;		/* centroid */
+	double cy;
+};
+typedef struct blob_s blob_t;
+
+struct blob_run_s
+{
+	int x0;
+	int x1;
+	int label;
+};
+typedef struct blob_run_s blob_run_t;
+
+struct blob_label_s
+{
+	int parent;		/* itself for the label a blob is known by */
+	int stamp;		/* last row that used or freed it */
+	unsigned long area;
+	unsigned long floor_area;
+	unsigned long sum_x;
+	unsigned long sum_y;
+	int x0;
+	int y0;
+	int x1;
+	int y1;
+};
+typedef struct blob_label_s blob_label_t;
+
+struct blob_labeller_s
+{
+	int width;
+	int row;
+	unsigned int weight;	/* floor each pixel of the current row covers */
+	blob_run_t* runs[2];	/* current row and the one above, swapped per row */
+	int nruns[2];
+	int cur;
+	blob_label_t* labels;
+	int* free_labels;
+	int nfree;
+	blob_t blobs[BLOB_MAX];	/* of the last frame, largest first once finished */
+	int nblobs;
+};
+typedef struct blob_labeller_s blob_labeller_t;
+
+int blob_labeller_resize(blob_labeller_t* labeller, int width)
+{
+	int max_runs = width / 2 + 1;
+
+	if (labeller->width == width)
+		return 0;
+
+	free(labeller->runs[0]);
+	free(labeller->runs[1]);
+	free(labeller->labels);
+	free(labeller->free_labels);
+
+	/* the runs of two rows never need more labels than that */
+	labeller->width = width;
+	labeller->runs[0] = (blob_run_t*) malloc(max_runs * sizeof(blob_run_t));
+	labeller->runs[1] = (blob_run_t*) malloc(max_runs * sizeof(blob_run_t));
+	labeller->labels = (blob_label_t*) malloc(2 * max_runs * sizeof(blob_label_t));
+	labeller->free_labels = (int*) malloc(2 * max_runs * sizeof(int));
+
+	if (!labeller->runs[0] || !labeller->runs[1] || !labeller->labels || !labeller->free_labels)
+	{
+		labeller->width = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+void blob_labeller_free(blob_labeller_t* labeller)
+{
+	free(labeller->runs[0]);
+	free(labeller->runs[1]);
+	free(labeller->labels);
+	free(labeller->free_labels);
+	memset(labeller, 0, sizeof(blob_labeller_t));
+}
+
+void blob_labeller_begin(blob_labeller_t* labeller)
+{
+	int k;
+
+	labeller->row = 0;
+	labeller->weight = 1;
+	labeller->cur = 0;
+	labeller->nruns[0] = 0;
+	labeller->nruns[1] = 0;
+	labeller->nblobs = 0;
+	labeller->nfree = 2 * (labeller->width / 2 + 1);
+
+	for (k = 0; k < labeller->nfree; k++)
+	{
+		labeller->free_labels[k] = labeller->nfree - 1 - k;
+		labeller->labels[k].stamp = -1;
+	}
+}
+
+/* appends the run [x0, x1] to the current row */
+void blob_labeller_run(blob_labeller_t* labeller, int x0, int x1)
+{
+	blob_run_t* run = &labeller->runs[labeller->cur][labeller->nruns[labeller->cur]++];
+
+	run->x0 = x0;
+	run->x1 = x1;
+}
+
+int blob_find(blob_label_t* labels, int label)
+{
+	while (labels[label].parent != label)
+	{
+		labels[label].parent = labels[labels[label].parent].parent;
+		label = labels[label].parent;
+	}
+
+	return label;
+}
+
+/* folds the blob of label b into the blob of label a */
+void blob_merge(blob_label_t* labels, int a, int b)
+{
+	labels[b].parent = a;
+	labels[a].area += labels[b].area;
+	labels[a].floor_area += labels[b].floor_area;
+	labels[a].sum_x += labels[b].sum_x;
+	labels[a].sum_y += labels[b].sum_y;
+	labels[a].x0 = MIN(labels[a].x0, labels[b].x0);
+	labels[a].y0 = MIN(labels[a].y0, labels[b].y0);
+	labels[a].x1 = MAX(labels[a].x1, labels[b].x1);
+	labels[a].y1 = MAX(labels[a].y1, labels[b].y1);
+}
+
+/* keeps the blob if it is among the largest of the frame */
+void blob_report(blob_labeller_t* labeller, blob_label_t* label)
+{
+	blob_t* blob;
+	int k;
+
+	if (labeller->nblobs < BLOB_MAX)
+	{
+		blob = &labeller->blobs[labeller->nblobs++];
+	}
+	else
+	{
+		blob = &labeller->blobs[0];
+
+		for (k = 1; k < BLOB_MAX; k++)
+		{
+			if (labeller->blobs[k].floor_area < blob->floor_area)
+				blob = &labeller->blobs[k];
+		}
+
+		if (blob->floor_area >= label->floor_area)
+			return;
+	}
+
+	blob->x0 = label->x0;
+	blob->y0 = label->y0;
+	blob->x1 = label->x1;
+	blob->y1 = label->y1;
+	blob->area = label->area;
+	blob->floor_area = label->floor_area;
+	blob->cx = (double) label->sum_x / label->area;
+	blob->cy = (double) label->sum_y / label->area;
+}
+
+/* joins the current row to the one above and reports the blobs that ended */
+void blob_labeller_end_row(blob_labeller_t* labeller)
+{
+	blob_label_t* labels = labeller->labels;
+	blob_run_t* cur = labeller->runs[labeller->cur];
+	blob_run_t* prev = labeller->runs[labeller->cur ^ 1];
+	int ncur = labeller->nruns[labeller->cur];
+	int nprev = labeller->nruns[labeller->cur ^ 1];
+	int row = labeller->row;
+	blob_label_t* l;
+	int label;
+	int root;
+	int i;
+	int j = 0;
+	int k;
+
+	for (i = 0; i < ncur; i++)
+	{
+		label = -1;
+
+		/* the runs above that touch this one, diagonals included */
+		while ((j < nprev) && (prev[j].x1 + 1 < cur[i].x0))
+			j++;
+
+		for (k = j; (k < nprev) && (prev[k].x0 <= cur[i].x1 + 1); k++)
+		{
+			root = blob_find(labels, prev[k].label);
+
+			if (label < 0)
+				label = root;
+			else if (root != label)
+				blob_merge(labels, label, root);
+		}
+
+		l = &labels[(label < 0) ? labeller->free_labels[--labeller->nfree] : label];
+
+		if (label < 0)
+		{
+			label = l - labels;
+			l->parent = label;
+			l->area = 0;
+			l->floor_area = 0;
+			l->sum_x = 0;
+			l->sum_y = 0;
+			l->x0 = cur[i].x0;
+			l->y0 = row;
+			l->x1 = cur[i].x1;
+			l->y1 = row;
+		}
+
+		l->area += cur[i].x1 - cur[i].x0 + 1;
+		l->floor_area += (unsigned long) (cur[i].x1 - cur[i].x0 + 1) * labeller->weight;
+		l->sum_x += (unsigned long) (cur[i].x0 + cur[i].x1) * (cur[i].x1 - cur[i].x0 + 1) / 2;
+		l->sum_y += (unsigned long) row * (cur[i].x1 - cur[i].x0 + 1);
+		l->x0 = MIN(l->x0, cur[i].x0);
+		l->x1 = MAX(l->x1, cur[i].x1);
+		l->y1 = row;
+		cur[i].label = label;
+	}
+
+	/* a merge may have retired the label a run got first */
+	for (i = 0; i < ncur; i++)
+	{
+		cur[i].label = blob_find(labels, cur[i].label);
+		labels[cur[i].label].stamp = row;
+	}
+
+	/* whatever the row above used and this row does not is finished */
+	for (k = 0; k < nprev; k++)
+	{
+		for (label = prev[k].label; labels[label].stamp != row; label = labels[label].parent)
+		{
+			if (labels[label].parent == label)
+				blob_report(labeller, &labels[label]);
+
+			labels[label].stamp = row;
+			labeller->free_labels[labeller->nfree++] = label;
+
+			if (labels[label].parent == label)
+				break;
+		}
+	}
+
+	labeller->row++;
+	labeller->cur ^= 1;
+	labeller->nruns[labeller->cur] = 0;
+}
+
+int blob_compare(const void* a, const void* b)
+{
+	unsigned long area_a = ((const blob_t*) a)->floor_area;
+	unsigned long area_b = ((const blob_t*) b)->floor_area;
+
+	return (area_a < area_b) - (area_a > area_b);
+}
+
+/* ends the frame: the blobs still open are reported too */
+void blob_labeller_finish(blob_labeller_t* labeller)
+{
+	blob_labeller_end_row(labeller);
+	qsort(labeller->blobs, labeller->nblobs, sizeof(blob_t), blob_compare);
+}
+
+/*
+	Where the camera sits, read from the calibration file. A pixel near
+	the horizon covers far more floor than one at the bottom of the
+	frame, so each row gets a weight proportional to the floor area of
+	its pixels and every count the classifier keeps is weighted by it.
+	For a camera without roll a pixel's floor area only depends on its
+	row, and the floor seen by a row is spread evenly over the columns,
+	so zones cut in equal-width column ranges are still equal on the
+	floor and only the rows need a table. The REPL's calibrate command
+	reloads the file; the cameras rebuild their tables when its
+	sequence number moves, and never otherwise.
+*/
+#define ROW_WEIGHT_MAX		(1 << 20)	/* of the row covering the most floor; 4095 rows still fit the bins */
+#define CALIBRATION_MAX_DISTANCE	300	/* cm, unless the file says otherwise */
+
+struct calibration_s
+{
+	int valid;		/* 0: every row weighs 1 */
+	double height;		/* cm, lens above the floor */
+	double pitch;		/* degrees the camera looks down */
+	double max_distance;	/* cm, floor further away weighs nothing */
+};
+typedef struct calibration_s calibration_t;
+
+static calibration_t calibration = { 0 };
+static unsigned int calibration_seq = 1;
+static pthread_mutex_t calibration_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* copies the calibration when it changed since seq, returns the sequence of the copy */
+unsigned int calibration_get(calibration_t* cal, unsigned int seq)
+{
+	if (__atomic_load_n(&calibration_seq, __ATOMIC_ACQUIRE) == seq)
+		return seq;
+
+	pthread_mutex_lock(&calibration_mutex);
+	*cal = calibration;
+	seq = calibration_seq;
+	pthread_mutex_unlock(&calibration_mutex);
+
+	return seq;
+}
+
+void calibration_set(calibration_t* cal)
+{
+	pthread_mutex_lock(&calibration_mutex);
+	calibration = *cal;
+	__atomic_add_fetch(&calibration_seq, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&calibration_mutex);
+}
+
+/* cm from the camera to where the ray through row offset yc (down from the centre) meets the floor, -1 above the horizon */
+double calibration_distance(calibration_t* cal, double focal, double yc)
+{
+	double pitch = cal->pitch * M_PI / 180.0;
+	double down = yc * cos(pitch) + focal * sin(pitch);
+
+	if (down <= 0)
+		return -1;
+
+	return cal->height * (focal * cos(pitch) - yc * sin(pitch)) / down;
+}
+
+/*
+	Fills weight[] for the rows of a height x width frame and returns
+	their sum. The floor area of a pixel is its lateral extent, the
+	distance along the ray over the focal length, times the depth
+	between the rays through its top and bottom edges.
+*/
+unsigned long calibration_row_weights(calibration_t* cal, int width, int height, unsigned int* weight)
+{
+	double focal = (width / 2.0) / tan(cfg->camera_fov * M_PI / 360.0);
+	double pitch = cal->pitch * M_PI / 180.0;
+	double cy = height / 2.0;
+	double max = 0;
+	double far;
+	double near;
+	double* area;
+	unsigned long total = 0;
+	int y;
+
+	if (!cal->valid || ((area = (double*) malloc(height * sizeof(double))) == NULL))
+	{
+		for (y = 0; y < height; y++)
+			weight[y] = 1;
+
+		return height;
+	}
+
+	for (y = 0; y < height; y++)
+	{
+		far = calibration_distance(cal, focal, y - cy);
+		near = calibration_distance(cal, focal, y + 1 - cy);
+
+		if ((far < 0) || (near < 0) || (far > cal->max_distance))
+			area[y] = 0;
+		else
+			area[y] = (far - near) * cal->height / ((y + 0.5 - cy) * cos(pitch) + focal * sin(pitch));
+
+		max = MAX(max, area[y]);
+	}
+
+	for (y = 0; y < height; y++)
+	{
+		weight[y] = (max > 0) ? (unsigned int) lround(ROW_WEIGHT_MAX * area[y] / max) : 1;
+
+		if ((area[y] > 0) && (weight[y] == 0))
+			weight[y] = 1;
+
+		total += weight[y];
+	}
+
+	free(area);
+
+	return total;
+}
+
+/*
+	Colour classifier. Each channel value is looked up in a 256-entry
+	table whose bit c is set when the value passes colour c's rule on
+	that channel, so ANDing the three lookups labels a pixel with every
+	class it belongs to at once. The frame keeps, per column, how many
+	pixels carry each combination of labels, weighted by the floor
+	their row covers; the per-class column counts and section totals
+	are folded out of those bins, so watching more classes costs no
+	extra pass.
+
+	Most frames barely differ from the last one, so the frame is cut in
+	CLASSIFIER_TILE square tiles and only the tiles where a sparse grid
+	of samples moved by more than change-threshold are classified again.
+	The label of every pixel is kept, and the bins are corrected by the
+	pixels whose label changed, so they always describe the whole frame.
+	Every rescan-interval frames all tiles are classified regardless, so
+	changes that slipped between the samples don't linger.
+
+	The per-pixel loop is compiled once per pixel layout: gray, BGR and
+	BGRA, with rows either packed back to back or padded to widthStep.
+	With the layout a constant the lookups of a row unroll without a
+	branch, and a row whose labels all stayed put costs one memcmp. The
+	variant is picked once per stream, when the layout changes.
+
+	The kernels also keep, for each of LINE_BANDS bands of rows, the
+	pixels of every label and the sum of their x, from which the
+	centroid of a class in each band, and the line through them, come
+	without looking at the labels again.
+
+	The change samples double as a luminance histogram of the frame:
+	whenever a sample is replaced its old luminance leaves the histogram
+	and the new one enters it, so an adaptive threshold can be read off
+	every frame without another pass over the pixels.
+*/
+#define COLOR_MASKS		(1 << COLOR_CLASSES)
+#define CLASSIFIER_TILE		32	/* pixels */
+#define CHANGE_SAMPLE_STEP	4	/* one sample every so many pixels and rows */
+
+/* indexed by color id and B, G, R: 1 when the channel must reach qualify, 0 when it must stay below */
+static const unsigned char color_rules[COLOR_CLASSES][3] =
+{
+	{ 1, 0, 0 },	/* blue */
+	{ 0, 1, 0 },	/* green */
+	{ 0, 0, 1 },	/* red */
+	{ 1, 1, 1 }	/* white */
+};
+
+struct color_classifier_s
+{
+	unsigned char table[3][256];
+	unsigned char gray[256];	/* table[0] & table[1] & table[2], for one-channel frames */
+	int qualify;			/* the tables were built for, -1 before the first build */
+	int width;
+	int height;
+	unsigned int* bins;		/* bins[x * COLOR_MASKS + mask], in row weights */
+	unsigned int* row_weight;	/* floor covered by a pixel of each row, see calibration_s */
+	unsigned long column_weight;	/* of a whole column */
+	unsigned int calibration;	/* sequence of the calibration the weights were built for */
+	unsigned int band_pixels[LINE_BANDS][COLOR_MASKS];	/* of each label in each band of rows */
+	unsigned long band_moment[LINE_BANDS][COLOR_MASKS];	/* sum of their x */
+	unsigned char* labels;		/* mask of every pixel of the last frame */
+	unsigned char* row;		/* masks of the row being classified */
+	unsigned char* samples;		/* B, G, R of the change grid, as last classified */
+	int nsamples;
+	unsigned int luma[256];		/* luminance histogram of the samples */
+	unsigned char* dirty;		/* per tile */
+	int tiles_x;
+	int tiles_y;
+	int rescan;			/* classify every tile of the next frame */
+	int since_rescan;		/* frames */
+	int tiles;			/* of the last frame */
+	int tiles_scanned;
+	int blob_color;			/* the blobs were labelled for, -1 when out of date */
+	int channels;
+	int step;			/* bytes per row */
+	struct classify_variant_s* variant;
+};
+typedef struct color_classifier_s color_classifier_t;
+
+/* classifies the pixels x0..x1 - 1 of rows y0..y1 - 1, moving the changed ones between bins */
+typedef void (*classify_kernel_t)(color_classifier_t* classifier, unsigned char* data,
+	int x0, int y0, int x1, int y1);
+
+#define CLASSIFY_KERNEL(_name, _channels, _packed) \
+void _name(color_classifier_t* classifier, unsigned char* data, \
+	int x0, int y0, int x1, int y1) \
+{ \
+	unsigned char (*table)[256] = classifier->table; \
+	unsigned char* gray = classifier->gray; \
+	unsigned char* masks = classifier->row; \
+	unsigned int* bins = classifier->bins; \
+	unsigned int* band_pixels; \
+	unsigned long* band_moment; \
+	unsigned int weight; \
+	unsigned char* pixel; \
+	unsigned char* label; \
+	int step = (_packed) ? classifier->width * (_channels) : classifier->step; \
+	int x; \
+	int y; \
+\
+	for (y = y0; y < y1; y++) \
+	{ \
+		pixel = data + y * step + x0 * (_channels); \
+		label = classifier->labels + y * classifier->width; \
+\
+		/* look the row up without branching, then compare it whole */ \
+		for (x = x0; x < x1; x++, pixel += (_channels)) \
+		{ \
+			if ((_channels) == 1) \
+				masks[x] = gray[pixel[0]]; \
+			else \
+				masks[x] = table[0][pixel[0]] & table[1][pixel[1]] & table[2][pixel[2]]; \
+		} \
+\
+		if (memcmp(masks + x0, label + x0, x1 - x0) == 0) \
+			continue; \
+\
+		weight = classifier->row_weight[y]; \
+		band_pixels = classifier->band_pixels[y * LINE_BANDS / classifier->height]; \
+		band_moment = classifier->band_moment[y * LINE_BANDS / classifier->height]; \
+\
+		for (x = x0; x < x1; x++) \
+		{ \
+			if (masks[x] != label[x]) \
+			{ \
+				bins[x * COLOR_MASKS + label[x]] -= weight; \
+				bins[x * COLOR_MASKS + masks[x]] += weight; \
+				band_pixels[label[x]]--; \
+				band_pixels[masks[x]]++; \
+				band_moment[label[x]] -= x; \
+				band_moment[masks[x]] += x; \
+				label[x] = masks[x]; \
+			} \
+		} \
+	} \
+}
+
+CLASSIFY_KERNEL(classify_gray_packed, 1, 1)
+CLASSIFY_KERNEL(classify_gray_padded, 1, 0)
+CLASSIFY_KERNEL(classify_bgr_packed, 3, 1)
+CLASSIFY_KERNEL(classify_bgr_padded, 3, 0)
+CLASSIFY_KERNEL(classify_bgra_packed, 4, 1)
+CLASSIFY_KERNEL(classify_bgra_padded, 4, 0)
+
+/* the layout read at run time, only for comparison in the vision benchmark */
+void classify_generic(color_classifier_t* classifier, unsigned char* data,
+	int x0, int y0, int x1, int y1)
+{
+	unsigned char (*table)[256] = classifier->table;
+	unsigned int* bins = classifier->bins;
+	unsigned int* band_pixels;
+	unsigned long* band_moment;
+	unsigned char* pixel;
+	unsigned char* label;
+	unsigned char mask;
+	unsigned int weight;
+	int channels = classifier->channels;
+	int x;
+	int y;
+
+	for (y = y0; y < y1; y++)
+	{
+		weight = classifier->row_weight[y];
+		band_pixels = classifier->band_pixels[y * LINE_BANDS / classifier->height];
+		band_moment = classifier->band_moment[y * LINE_BANDS / classifier->height];
+		pixel = data + y * classifier->step + x0 * channels;
+		label = classifier->labels + y * classifier->width + x0;
+
+		for (x = x0; x < x1; x++, pixel += channels, label++)
+		{
+			if (channels == 1)
+				mask = classifier->gray[pixel[0]];
+			else
+				mask = table[0][pixel[0]] & table[1][pixel[1]] & table[2][pixel[2]];
+
+			if (mask != *label)
+			{
+				bins[x * COLOR_MASKS + *label] -= weight;
+				bins[x * COLOR_MASKS + mask] += weight;
+				band_pixels[*label]--;
+				band_pixels[mask]++;
+				band_moment[*label] -= x;
+				band_moment[mask] += x;
+				*label = mask;
+			}
+		}
+	}
+}
+
+struct classify_variant_s
+{
+	char* name;
+	int channels;
+	int packed;
+	classify_kernel_t kernel;
+};
+typedef struct classify_variant_s classify_variant_t;
+
+static classify_variant_t classify_variants[] =
+{
+	{ "gray, packed",	1, 1, classify_gray_packed },
+	{ "gray, padded",	1, 0, classify_gray_padded },
+	{ "bgr, packed",	3, 1, classify_bgr_packed },
+	{ "bgr, padded",	3, 0, classify_bgr_padded },
+	{ "bgra, packed",	4, 1, classify_bgra_packed },
+	{ "bgra, padded",	4, 0, classify_bgra_padded }
+};
+
+void color_classifier_build(color_classifier_t* classifier, int qualify)
+{
+	int c;
+	int ch;
+	int v;
+
+	memset(classifier->table, 0, sizeof(classifier->table));
+
+	for (ch = 0; ch < 3; ch++)
+	{
+		for (v = 0; v < 256; v++)
+		{
+			for (c = 0; c < COLOR_CLASSES; c++)
+			{
+				if ((v >= qualify) == color_rules[c][ch])
+					classifier->table[ch][v] |= 1 << c;
+			}
+		}
+	}
+
+	for (v = 0; v < 256; v++)
+		classifier->gray[v] = classifier->table[0][v] & classifier->table[1][v] & classifier->table[2][v];
+
+	classifier->qualify = qualify;
+}
+
+/* forgets the last frame: every pixel unlabelled, so the next frame is classified in full */
+void color_classifier_reset(color_classifier_t* classifier)
+{
+	int band;
+	int x;
+	int y;
+
+	memset(classifier->labels, 0, classifier->width * classifier->height);
+	memset(classifier->bins, 0, classifier->width * COLOR_MASKS * sizeof(unsigned int));
+	memset(classifier->band_pixels, 0, sizeof(classifier->band_pixels));
+	memset(classifier->band_moment, 0, sizeof(classifier->band_moment));
+	memset(classifier->samples, 0, 3 * classifier->nsamples);
+	memset(classifier->luma, 0, sizeof(classifier->luma));
+
+	for (x = 0; x < classifier->width; x++)
+		classifier->bins[x * COLOR_MASKS] = classifier->column_weight;
+
+	for (y = 0; y < classifier->height; y++)
+	{
+		band = y * LINE_BANDS / classifier->height;
+		classifier->band_pixels[band][0] += classifier->width;
+		classifier->band_moment[band][0] += (unsigned long) classifier->width * (classifier->width - 1) / 2;
+	}
+
+	classifier->luma[0] = classifier->nsamples;
+
+	classifier->rescan = 1;
+	classifier->blob_color = -1;
+}
+
+void color_classifier_free(color_classifier_t* classifier)
+{
+	free(classifier->bins);
+	free(classifier->row_weight);
+	free(classifier->labels);
+	free(classifier->row);
+	free(classifier->samples);
+	free(classifier->dirty);
+	memset(classifier, 0, sizeof(color_classifier_t));
+}
+
+/* sizes the buffers for the frame and rebuilds the tables when qualify changed */
+int color_classifier_prepare(color_classifier_t* classifier, int width, int height, int qualify)
+{
+	int y;
+
+	if ((classifier->width != width) || (classifier->height != height))
+	{
+		free(classifier->bins);
+		free(classifier->row_weight);
+		free(classifier->labels);
+		free(classifier->row);
+		free(classifier->samples);
+		free(classifier->dirty);
+
+		classifier->width = width;
+		classifier->height = height;
+		classifier->tiles_x = (width + CLASSIFIER_TILE - 1) / CLASSIFIER_TILE;
+		classifier->tiles_y = (height + CLASSIFIER_TILE - 1) / CLASSIFIER_TILE;
+		classifier->bins = (unsigned int*) malloc(width * COLOR_MASKS * sizeof(unsigned int));
+		classifier->row_weight = (unsigned int*) malloc(height * sizeof(unsigned int));
+		classifier->labels = (unsigned char*) malloc(width * height);
+		classifier->row = (unsigned char*) malloc(width);
+		classifier->nsamples = ((width + CHANGE_SAMPLE_STEP - 1) / CHANGE_SAMPLE_STEP) *
+			((height + CHANGE_SAMPLE_STEP - 1) / CHANGE_SAMPLE_STEP);
+		classifier->samples = (unsigned char*) malloc(3 * classifier->nsamples);
+		classifier->dirty = (unsigned char*) malloc(classifier->tiles_x * classifier->tiles_y);
+
+		if (!classifier->bins || !classifier->row_weight || !classifier->labels || !classifier->row ||
+			!classifier->samples || !classifier->dirty)
+		{
+			color_classifier_free(classifier);
+			classifier->qualify = -1;
+			return -1;
+		}
+
+		/* flat until calibrated */
+		for (y = 0; y < height; y++)
+			classifier->row_weight[y] = 1;
+
+		classifier->column_weight = height;
+		classifier->calibration = 0;
+		color_classifier_reset(classifier);
+	}
+
+	if (classifier->qualify != qualify)
+	{
+		color_classifier_build(classifier, qualify);
+		color_classifier_reset(classifier);
+	}
+
+	return 0;
+}
+
+/* weighs the rows for the calibration numbered seq, unless they already are */
+void color_classifier_calibrate(color_classifier_t* classifier, calibration_t* cal, unsigned int seq)
+{
+	if (classifier->calibration == seq)
+		return;
+
+	classifier->column_weight = calibration_row_weights(cal, classifier->width, classifier->height,
+		classifier->row_weight);
+	classifier->calibration = seq;
+	color_classifier_reset(classifier);
+}
+
+/* picks the kernel for the frames' layout, -1 when there is none */
+int color_classifier_layout(color_classifier_t* classifier, int channels, int step)
+{
+	int packed = (step == classifier->width * channels);
+	int k;
+
+	if (classifier->variant && (classifier->variant->packed == packed) &&
+		(classifier->channels == channels) && (classifier->step == step))
+		return 0;
+
+	for (k = 0; k < NELEMENTS(classify_variants); k++)
+	{
+		if ((classify_variants[k].channels == channels) && (classify_variants[k].packed == packed))
+		{
+			classifier->variant = &classify_variants[k];
+			classifier->channels = channels;
+			classifier->step = step;
+			color_classifier_reset(classifier);
+			return 0;
+		}
+	}
+
+	classifier->variant = NULL;
+	return -1;
+}
+
+/* BT.601 luminance of a sample */
+static inline int sample_luma(unsigned char* sample, int channels)
+{
+	if (channels == 1)
+		return sample[0];
+
+	return (29 * sample[0] + 150 * sample[1] + 77 * sample[2]) >> 8;
+}
+
+/*
+	Marks the tiles whose samples moved and, with store, records the
+	samples of the dirty tiles as the reference for the next frame,
+	moving them in the luminance histogram. Returns the number of dirty
+	tiles.
+*/
+int color_classifier_changes(color_classifier_t* classifier, unsigned char* data, int store)
+{
+	unsigned char* sample = classifier->samples;
+	unsigned char* pixel;
+	unsigned char* dirty;
+	int threshold = cfg->change_threshold;
+	int channels = classifier->channels;
+	int compared = MIN(channels, 3);
+	int ndirty = 0;
+	int ch;
+	int x;
+	int y;
+
+	for (y = 0; y < classifier->height; y += CHANGE_SAMPLE_STEP)
+	{
+		dirty = classifier->dirty + (y / CLASSIFIER_TILE) * classifier->tiles_x;
+
+		for (x = 0; x < classifier->width; x += CHANGE_SAMPLE_STEP, sample += 3)
+		{
+			pixel = data + y * classifier->step + x * channels;
+
+			if (store)
+			{
+				if (dirty[x / CLASSIFIER_TILE])
+				{
+					--classifier->luma[sample_luma(sample, channels)];
+					memcpy(sample, pixel, compared);
+					++classifier->luma[sample_luma(sample, channels)];
+				}
+
+				continue;
+			}
+
+			if (dirty[x / CLASSIFIER_TILE])
+				continue;
+
+			for (ch = 0; ch < compared; ch++)
+			{
+				if (abs(pixel[ch] - sample[ch]) > threshold)
+				{
+					dirty[x / CLASSIFIER_TILE] = 1;
+					ndirty++;
+					break;
+				}
+			}
+		}
+	}
+
+	return ndirty;
+}
+
+/* feeds the runs of class color in the labels of the last frame to the blob labeller */
+void color_classifier_blobs(color_classifier_t* classifier, blob_labeller_t* blobs, int color)
+{
+	unsigned char* label = classifier->labels;
+	unsigned char bit = 1 << color;
+	int start;
+	int x;
+	int y;
+
+	blob_labeller_begin(blobs);
+
+	for (y = 0; y < classifier->height; y++)
+	{
+		blobs->weight = classifier->row_weight[y];
+		start = -1;
+
+		for (x = 0; x < classifier->width; x++, label++)
+		{
+			if (*label & bit)
+			{
+				if (start < 0)
+					start = x;
+			}
+			else if (start >= 0)
+			{
+				blob_labeller_run(blobs, start, x - 1);
+				start = -1;
+			}
+		}
+
+		if (start >= 0)
+			blob_labeller_run(blobs, start, classifier->width - 1);
+
+		blob_labeller_end_row(blobs);
+	}
+
+	blob_labeller_finish(blobs);
+	classifier->blob_color = color;
+}
+
+/*
+	Brings the labels, the bins and, when given, the blobs of class
+	color up to date with a new frame, classifying only what changed.
+*/
+void color_classifier_run(color_classifier_t* classifier, unsigned char* data,
+	blob_labeller_t* blobs, int color)
+{
+	classify_kernel_t kernel = classifier->variant->kernel;
+	int ntiles = classifier->tiles_x * classifier->tiles_y;
+	int ndirty;
+	int x0;
+	int y0;
+	int k;
+
+	if (classifier->rescan || (cfg->change_threshold == 0) ||
+		(++classifier->since_rescan >= cfg->rescan_interval))
+	{
+		memset(classifier->dirty, 1, ntiles);
+		classifier->rescan = 0;
+		classifier->since_rescan = 0;
+		ndirty = ntiles;
+	}
+	else
+	{
+		memset(classifier->dirty, 0, ntiles);
+		ndirty = color_classifier_changes(classifier, data, 0);
+	}
+
+	if (ndirty == ntiles)
+	{
+		/* whole rows make longer runs for the kernel than tiles do */
+		kernel(classifier, data, 0, 0, classifier->width, classifier->height);
+	}
+	else
+	{
+		for (k = 0; k < ntiles; k++)
+		{
+			if (classifier->dirty[k])
+			{
+				x0 = (k % classifier->tiles_x) * CLASSIFIER_TILE;
+				y0 = (k / classifier->tiles_x) * CLASSIFIER_TILE;
+				kernel(classifier, data, x0, y0, MIN(x0 + CLASSIFIER_TILE, classifier->width),
+					MIN(y0 + CLASSIFIER_TILE, classifier->height));
+			}
+		}
+	}
+
+	if (ndirty > 0)
+	{
+		color_classifier_changes(classifier, data, 1);
+		classifier->blob_color = -1;
+	}
+
+	if (blobs && (classifier->blob_color != color))
+		color_classifier_blobs(classifier, blobs, color);
+
+	classifier->tiles = ntiles;
+	classifier->tiles_scanned = ndirty;
+}
+
+/* floor covered by one class in each column, in row weights */
+void color_classifier_columns(color_classifier_t* classifier, int color, unsigned int* count)
+{
+	unsigned int* bins;
+	int mask;
+	int x;
+
+	for (x = 0; x < classifier->width; x++)
+	{
+		bins = classifier->bins + x * COLOR_MASKS;
+		count[x] = 0;
+
+		/* every mask with the colour's bit set, in increasing order */
+		for (mask = 1 << color; mask < COLOR_MASKS; mask = (mask + 1) | (1 << color))
+			count[x] += bins[mask];
+	}
+}
+
+/* per mille of the floor of each of nsections equal-width sections covered by each class */
+void color_classifier_sections(color_classifier_t* classifier, int nsections,
+	unsigned int (*coverage)[3])
+{
+	unsigned long totals[COLOR_MASKS];
+	unsigned long pixels;
+	unsigned long total;
+	unsigned int* bins;
+	int section;
+	int mask;
+	int x0;
+	int x1;
+	int c;
+	int x;
+
+	for (section = 0; section < nsections; section++)
+	{
+		x0 = (section * classifier->width) / nsections;
+		x1 = ((section + 1) * classifier->width) / nsections;
+		pixels = (unsigned long) (x1 - x0) * classifier->column_weight;
+		memset(totals, 0, sizeof(totals));
+
+		for (x = x0; x < x1; x++)
+		{
+			bins = classifier->bins + x * COLOR_MASKS;
+
+			for (mask = 1; mask < COLOR_MASKS; mask++)
+				totals[mask] += bins[mask];
+		}
+
+		for (c = 0; c < COLOR_CLASSES; c++)
+		{
+			total = 0;
+
+			for (mask = 1 << c; mask < COLOR_MASKS; mask = (mask + 1) | (1 << c))
+				total += totals[mask];
+
+			__atomic_store_n(&coverage[c][section],
+				pixels ? (unsigned int) (1000 * total / pixels) : 0, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/*
+	Fits the line of class color through the centroids of its pixels
+	in each band of rows, kept up to date by the kernels. Calibrated,
+	each centroid is projected onto the floor, in cm; otherwise the
+	frame is taken as a view straight down, in pixels. Either way the
+	heading and the bearing of the offset are angles, so the gains
+	stay the same.
+*/
+void color_classifier_line(color_classifier_t* classifier, calibration_t* cal, int color, line_t* line)
+{
+	double focal = (classifier->width / 2.0) / tan(cfg->camera_fov * M_PI / 360.0);
+	double pitch = cal->pitch * M_PI / 180.0;
+	double sum_f = 0;
+	double sum_l = 0;
+	double sum_ff = 0;
+	double sum_fl = 0;
+	double forward;
+	double lateral;
+	double slope;
+	double down;
+	double xc;
+	double yc;
+	unsigned long pixels;
+	unsigned long moment;
+	int first;
+	int last;
+	int band;
+	int mask;
+	int n = 0;
+
+	for (band = 0; band < LINE_BANDS; band++)
+	{
+		pixels = 0;
+		moment = 0;
+
+		for (mask = 1 << color; mask < COLOR_MASKS; mask = (mask + 1) | (1 << color))
+		{
+			pixels += classifier->band_pixels[band][mask];
+			moment += classifier->band_moment[band][mask];
+		}
+
+		/* rows y with y * LINE_BANDS / height == band */
+		first = (band * classifier->height + LINE_BANDS - 1) / LINE_BANDS;
+		last = ((band + 1) * classifier->height + LINE_BANDS - 1) / LINE_BANDS - 1;
+
+		if ((last < first) || (1000 * pixels < (unsigned long) LINE_BAND_MIN * (last - first + 1) * classifier->width))
+			continue;
+
+		/* from the centre of the frame to the centre of the pixels */
+		xc = (double) moment / pixels + 0.5 - classifier->width / 2.0;
+		yc = (first + last + 1) / 2.0 - classifier->height / 2.0;
+
+		if (cal->valid)
+		{
+			down = yc * cos(pitch) + focal * sin(pitch);
+
+			if (down <= 0)
+				continue;
+
+			forward = cal->height * (focal * cos(pitch) - yc * sin(pitch)) / down;
+			lateral = cal->height * xc / down;
+
+			if (forward > cal->max_distance)
+				continue;
+		}
+		else
+		{
+			forward = classifier->height / 2.0 - yc;
+			lateral = xc;
+		}
+
+		sum_f += forward;
+		sum_l += lateral;
+		sum_ff += forward * forward;
+		sum_fl += forward * lateral;
+		n++;
+	}
+
+	line->bands = n;
+	line->valid = (n >= LINE_MIN_BANDS) && (n * sum_ff - sum_f * sum_f > 0);
+
+	if (!line->valid)
+		return;
+
+	/* least squares of lateral = offset + slope * forward */
+	slope = (n * sum_fl - sum_f * sum_l) / (n * sum_ff - sum_f * sum_f);
+	line->offset = (sum_l - slope * sum_f) / n;
+	line->heading = atan(slope) * 180.0 / M_PI;
+
+	/* bearing of the offset as seen from the middle of the fitted stretch */
+	line->error = line->heading + atan2(line->offset, sum_f / n) * 180.0 / M_PI;
+}
+
+/*
+	Otsu's threshold of the luminance histogram, as the first level of
+	the bright class. Levels no sample has leave the variance between
+	the classes unchanged, so the threshold goes to the middle of such
+	a gap rather than hugging the dark class.
+*/
+int color_classifier_otsu(color_classifier_t* classifier)
+{
+	unsigned int* luma = classifier->luma;
+	double sum = 0;
+	double sum_dark = 0;
+	double mean_dark;
+	double mean_bright;
+	double variance;
+	double best = -1;
+	unsigned long dark = 0;
+	unsigned long total = classifier->nsamples;
+	int first = 0;
+	int last = 0;
+	int v;
+
+	for (v = 0; v < 256; v++)
+		sum += (double) v * luma[v];
+
+	for (v = 0; v < 255; v++)
+	{
+		dark += luma[v];
+		sum_dark += (double) v * luma[v];
+
+		if ((dark == 0) || (dark == total))
+			continue;
+
+		mean_dark = sum_dark / dark;
+		mean_bright = (sum - sum_dark) / (total - dark);
+		variance = (double) dark * (total - dark) * (mean_dark - mean_bright) * (mean_dark - mean_bright);
+
+		if (variance > best)
+		{
+			best = variance;
+			first = v + 1;
+			last = v + 1;
+		}
+		else if (variance == best)
+		{
+			last = v + 1;
+		}
+	}
+
+	return (first + last) / 2;
+}
+
+/* the luminance percent of the histogram is darker than */
+int color_classifier_percentile(color_classifier_t* classifier, int percent)
+{
+	unsigned long wanted = (unsigned long) classifier->nsamples * percent / 100;
+	unsigned long dark = 0;
+	int v;
+
+	for (v = 0; v < 255; v++)
+	{
+		dark += classifier->luma[v];
+
+		if (dark > wanted)
+			break;
+	}
+
+	return v;
+}
+
+/*
+	Moving average of the adaptive threshold. The tables are only
+	rebuilt, and the frame classified in full, once the average has
+	moved THRESHOLD_HYSTERESIS levels away from the threshold in use.
+*/
+#define THRESHOLD_HYSTERESIS	2	/* luminance levels */
+
+struct threshold_filter_s
+{
+	double value;
+	int qualify;			/* in use, -1 until the first frame was seen */
+};
+typedef struct threshold_filter_s threshold_filter_t;
+
+/* the threshold to classify the next frame with */
+int threshold_filter_qualify(threshold_filter_t* filter, int fixed)
+{
+	if ((cfg->threshold == THRESHOLD_FIXED) || (filter->qualify < 0))
+		return fixed;
+
+	return filter->qualify;
+}
+
+void threshold_filter_update(threshold_filter_t* filter, color_classifier_t* classifier)
+{
+	int threshold;
+
+	if (cfg->threshold == THRESHOLD_FIXED)
+		return;
+
+	if (cfg->threshold == THRESHOLD_OTSU)
+		threshold = color_classifier_otsu(classifier);
+	else
+		threshold = color_classifier_percentile(classifier, cfg->threshold_percentile);
+
+	if (filter->qualify < 0)
+		filter->value = threshold;
+	else
+		filter->value += cfg->threshold_smoothing * (threshold - filter->value);
+
+	if ((filter->qualify < 0) || (fabs(filter->value - filter->qualify) >= THRESHOLD_HYSTERESIS))
+		filter->qualify = (int) lround(filter->value);
+}
+
+/*
+	Number of qualifying pixels in each column of a frame. The prefix
+	sums let any range of columns be totalled in O(1), so zones, the
+	centroid and the steering angle are all derived without rescanning.
+*/
+struct column_hist_s
+{
+	int width;
+	int height;
+	unsigned int* count;
+	unsigned long* integral;	/* integral[x] = count[0] + ... + count[x - 1] */
+	unsigned long* moment;		/* moment[x] = 0 * count[0] + ... + (x - 1) * count[x - 1] */
+};
+typedef struct column_hist_s column_hist_t;
+
+int column_hist_resize(column_hist_t* hist, int width, int height)
+{
+	hist->height = height;
+
+	if (hist->width == width)
+		return 0;
+
+	free(hist->count);
+	free(hist->integral);
+	free(hist->moment);
+
+	hist->width = width;
+	hist->count = (unsigned int*) calloc(width, sizeof(unsigned int));
+	hist->integral = (unsigned long*) calloc(width + 1, sizeof(unsigned long));
+	hist->moment = (unsigned long*) calloc(width + 1, sizeof(unsigned long));
+
+	if (!hist->count || !hist->integral || !hist->moment)
+	{
+		hist->width = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+void column_hist_free(column_hist_t* hist)
+{
+	free(hist->count);
+	free(hist->integral);
+	free(hist->moment);
+	memset(hist, 0, sizeof(column_hist_t));
+}
+
+void column_hist_integrate(column_hist_t* hist)
+{
+	int x;
+
+	hist->integral[0] = 0;
+	hist->moment[0] = 0;
+
+	for (x = 0; x < hist->width; x++)
+	{
+		hist->integral[x + 1] = hist->integral[x] + hist->count[x];
+		hist->moment[x + 1] = hist->moment[x] + (unsigned long) x * hist->count[x];
+	}
+}
+
+unsigned long column_hist_range(column_hist_t* hist, int x0, int x1)
+{
+	return hist->integral[x1] - hist->integral[x0];
+}
+
+/* splits the frame into nzones equal-width vertical zones */
+void column_hist_zones(column_hist_t* hist, int nzones, unsigned long* totals)
+{
+	int k;
+
+	for (k = 0; k < nzones; k++)
+	{
+		totals[k] = column_hist_range(hist,
+			(k * hist->width) / nzones, ((k + 1) * hist->width) / nzones);
+	}
+}
+
+/* returns 0 and leaves centroid untouched when the range is empty */
+int column_hist_centroid(column_hist_t* hist, int x0, int x1, double* centroid)
+{
+	unsigned long total;
+
+	total = column_hist_range(hist, x0, x1);
+
+	if (total == 0)
+		return 0;
+
+	*centroid = (double) (hist->moment[x1] - hist->moment[x0]) / total;
+
+	return 1;
+}
+
+/* angle in degrees from the camera axis to the centroid of the whole frame */
+int column_hist_steering(column_hist_t* hist)
+{
+	double centroid;
+	double offset;
+
+	if (!column_hist_centroid(hist, 0, hist->width, &centroid))
+		return 0;
+
+	/* -1.0 at the left edge, 1.0 at the right edge */
+	offset = (centroid - (hist->width - 1) / 2.0) / (hist->width / 2.0);
+
+	return (int) (atan(offset * tan(cfg->camera_fov * M_PI / 360.0)) * 180.0 / M_PI);
+}
+
+/*
+	Exponential moving average of the section percentages and the
+	steering angle, plus the decision currently held so that the
+	thresholds can be applied with hysteresis.
+*/
+struct decision_filter_s
+{
+	int primed;
+	double percent[3];
+	double victory;		/* percent of the left section covered by the marker */
+	double steering;
+	int direction;
+};
+typedef struct decision_filter_s decision_filter_t;
+
+void decision_filter_update(decision_filter_t* filter, double* percent, double victory, int steering)
+{
+	int k;
+
+	if (!filter->primed)
+	{
+		for (k = 0; k < 3; k++)
+			filter->percent[k] = percent[k];
+
+		filter->victory = victory;
+		filter->steering = steering;
+		filter->direction = -2;
+		filter->primed = 1;
+		return;
+	}
+
+	for (k = 0; k < 3; k++)
+		filter->percent[k] += cfg->decision_smoothing * (percent[k] - filter->percent[k]);
+
+	filter->victory += cfg->decision_smoothing * (victory - filter->victory);
+
+	filter->steering += cfg->decision_smoothing * (steering - filter->steering);
+}
+
+/* a decision is easier to keep than to enter, which stops it flickering */
+double decision_threshold(decision_filter_t* filter, int direction, double threshold)
+{
+	if (filter->direction == direction)
+		return threshold - cfg->decision_hysteresis;
+
+	return threshold + cfg->decision_hysteresis;
+}
+
+/*
+	What a stream of frames carries from one frame to the next: the
+	tiles already classified, the light, the calibration and the
+	smoothed decision. A camera runs one; so does every evaluation
+	of a recording, with the very same code.
+*/
+struct vision_s
+{
+	column_hist_t hist;
+	color_classifier_t classifier;
+	threshold_filter_t threshold;
+	calibration_t cal;
+	unsigned int cal_seq;
+	blob_labeller_t blobs;
+	decision_filter_t filter;
+	blob_t* marker;		/* victory marker of the last frame, NULL when none */
+	double section_floor;	/* floor each section sees, in weighted pixels */
+	line_t line;		/* of the target colour */
+	int qualify;		/* threshold the last frame was classified with */
+};
+typedef struct vision_s vision_t;
+
+#define VISION_NO_MEMORY	-1
+#define VISION_BAD_LAYOUT	-2
+
+void vision_init(vision_t* vision)
+{
+	memset(vision, 0, sizeof(vision_t));
+	vision->classifier.qualify = -1;
+	vision->threshold.qualify = -1;
+}
+
+/* forgets the frames before, for a stream that starts over */
+void vision_restart(vision_t* vision)
+{
+	memset(&vision->filter, 0, sizeof(decision_filter_t));
+	vision->threshold.qualify = -1;
+	vision->classifier.rescan = 1;
+}
+
+void vision_free(vision_t* vision)
+{
+	column_hist_free(&vision->hist);
+	color_classifier_free(&vision->classifier);
+	blob_labeller_free(&vision->blobs);
+}
+
+/*
+	Segments a frame and feeds the decision filter with the share of
+	floor each section covers. Returns 0, VISION_NO_MEMORY or
+	VISION_BAD_LAYOUT when no classification kernel takes the frame.
+*/
+int vision_analyse(vision_t* vision, IplImage* frame, vision_params_t* params)
+{
+	color_classifier_t* classifier = &vision->classifier;
+	unsigned int screen_segment = frame->width / 3;
+	unsigned long totals[3];
+	double percent[3];
+	double victory;
+	int k;
+
+	vision->qualify = threshold_filter_qualify(&vision->threshold, params->qualify);
+
+	if ((column_hist_resize(&vision->hist, frame->width, frame->height) < 0) ||
+		(color_classifier_prepare(classifier, frame->width, frame->height, vision->qualify) < 0) ||
+		(blob_labeller_resize(&vision->blobs, frame->width) < 0))
+	{
+		return VISION_NO_MEMORY;
+	}
+
+	if (color_classifier_layout(classifier, frame->nChannels, frame->widthStep) < 0)
+		return VISION_BAD_LAYOUT;
+
+	/* the row weights only change with the calibration, or the frame size */
+	vision->cal_seq = calibration_get(&vision->cal, vision->cal_seq);
+	color_classifier_calibrate(classifier, &vision->cal, vision->cal_seq);
+
+	/* labels every colour where the frame changed and finds the blobs of the target colour, which steers */
+	color_classifier_run(classifier, (unsigned char*) frame->imageData, &vision->blobs, params->color);
+
+	/* the light of this frame picks the threshold of the next one */
+	threshold_filter_update(&vision->threshold, classifier);
+	color_classifier_columns(classifier, params->color, vision->hist.count);
+
+	column_hist_integrate(&vision->hist);
+	column_hist_zones(&vision->hist, 3, totals);
+
+	/* shares of the floor each section sees */
+	vision->section_floor = (double) screen_segment * classifier->column_weight;
+
+	for (k = 0; k < 3; k++)
+		percent[k] = 100 * (double) totals[k] / vision->section_floor;
+
+	/* the marker is the largest blob centred in the left section, scattered pixels don't add up */
+	vision->marker = NULL;
+
+	for (k = 0; (k < vision->blobs.nblobs) && (vision->marker == NULL); k++)
+	{
+		if (vision->blobs.blobs[k].cx < screen_segment)
+			vision->marker = &vision->blobs.blobs[k];
+	}
+
+	victory = vision->marker ? 100 * (double) vision->marker->floor_area / vision->section_floor : 0;
+
+	decision_filter_update(&vision->filter, percent, victory, column_hist_steering(&vision->hist));
+	color_classifier_line(classifier, &vision->cal, params->color, &vision->line);
+
+	return 0;
+}
+
+/*
+	Note - This is your intelligence!
+	Watch it crumble! Picks the direction from the smoothed shares
+	and stores it in the filter, which keeps it a little stickier
+	for the next frame.
+*/
+int vision_decide(decision_filter_t* filter, vision_params_t* params)
+{
+	double* percent = filter->percent;
+
+	/* left case */
+	if (filter->victory >= decision_threshold(filter, -1, params->victory))
+		filter->direction = -1;
+	else if ((percent[2] > percent[1]) && (percent[2] > percent[0]) &&
+		(percent[2] >= decision_threshold(filter, 1, params->direction)))
+		filter->direction = 1;
+
+	/* right case */
+	else if ((percent[0] > percent[1]) && (percent[0] > percent[2]) &&
+		(percent[0] >= decision_threshold(filter, 3, params->direction)))
+		filter->direction = 3;
+
+	/* forward case */
+	else if ((percent[1] > percent[0]) && (percent[1] > percent[2]) &&
+		(percent[1] >= decision_threshold(filter, 2, params->direction)))
+		filter->direction = 2;
+
+	/* default */
+	else
+		filter->direction = -2;
+
+	return filter->direction;
+}
+
+char* direction_name(int direction)
+{
+	switch (direction)
+	{
+		case -1: return "[victory]";
+		case 1: return "[left]";
+		case 2: return "[forward]";
+		case 3: return "[right]";
+	}
+
+	return "[default]";
+}
+
+/*
+	Debug video stream. While a browser watches
+	http://127.0.0.1:<debug-stream>/<camera>, that camera offers one
+	frame every 1/debug-fps s to a small ring, with what it made of it.
+	A thread under SCHED_IDLE draws the sections, the mask and the
+	decision over the frame, encodes it to JPEG and sends it as the
+	next part of a multipart/x-mixed-replace response. The camera never
+	waits: when the ring is locked or every slot is being encoded the
+	sample is skipped. highgui reuses the captured image for the next
+	frame, so the sampled frames, and only those, are copied into the
+	slot they go out from.
+*/
+#define DEBUG_RING		3
+#define DEBUG_MAX_CLIENTS	4
+#define DEBUG_JPEG_QUALITY	70
+
+#define DEBUG_REQUEST_TIMEOUT	1000	/* ms a client has to send its request */
+
+#define DEBUG_FREE		0
+#define DEBUG_READY		1	/* waiting for the encoder */
+#define DEBUG_ENCODING		2
+
+#define DEBUG_PENDING		-1	/* client_camera of a client yet to send its request */
+
+struct debug_frame_s
+{
+	int state;
+	unsigned long seq;		/* order of sampling */
+	int camera;
+	IplImage* image;		/* as captured */
+	unsigned char* labels;		/* classes of each pixel */
+	int color;
+	int qualify;
+	double percent[3];
+	int steering;
+	char direction[10];
+	int marker;			/* whether there is one */
+	blob_t blob;
+};
+typedef struct debug_frame_s debug_frame_t;
+
+static debug_frame_t debug_ring[DEBUG_RING];
+static unsigned long debug_seq = 0;
+static pthread_mutex_t debug_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int debug_event_fd = -1;		/* counts the samples put in the ring */
+static int debug_watchers[MAX_CAMERAS];	/* clients of each camera */
+
+/* offers the frame to the debug stream, when it is due and someone watches */
+void debug_stream_sample(camera_t* camera, IplImage* frame, color_classifier_t* classifier,
+	decision_filter_t* filter, char* direction, blob_t* marker, int color, int qualify, long* due)
+{
+	debug_frame_t* slot = NULL;
+	long now;
+	int k;
+
+	if ((debug_event_fd < 0) || (__atomic_load_n(&debug_watchers[camera->id], __ATOMIC_RELAXED) == 0))
+		return;
+
+	now = monotonic_ms();
+
+	if ((now < *due) || (pthread_mutex_trylock(&debug_mutex) != 0))
+		return;
+
+	/* a free slot, or else the oldest sample nobody picked up yet */
+	for (k = 0; k < DEBUG_RING; k++)
+	{
+		if (debug_ring[k].state == DEBUG_FREE)
+		{
+			slot = &debug_ring[k];
+			break;
+		}
+
+		if ((debug_ring[k].state == DEBUG_READY) && ((slot == NULL) || (debug_ring[k].seq < slot->seq)))
+			slot = &debug_ring[k];
+	}
+
+	if ((slot != NULL) && ((slot->image == NULL) || (slot->image->width != frame->width) ||
+		(slot->image->height != frame->height) || (slot->image->nChannels != frame->nChannels)))
+	{
+		cvReleaseImage(&slot->image);
+		free(slot->labels);
+		slot->image = cvCreateImage(cvSize(frame->width, frame->height), IPL_DEPTH_8U, frame->nChannels);
+		slot->labels = (unsigned char*) malloc(frame->width * frame->height);
+
+		if ((slot->image == NULL) || (slot->labels == NULL))
+		{
+			cvReleaseImage(&slot->image);
+			free(slot->labels);
+			slot->labels = NULL;
+			slot->state = DEBUG_FREE;
+			slot = NULL;
+		}
+	}
+
+	if (slot != NULL)
+	{
+		cvCopy(frame, slot->image, NULL);
+		memcpy(slot->labels, classifier->labels, frame->width * frame->height);
+		slot->camera = camera->id;
+		slot->color = color;
+		slot->qualify = qualify;
+		memcpy(slot->percent, filter->percent, sizeof(slot->percent));
+		slot->steering = (int) filter->steering;
+		strcpy(slot->direction, direction);
+		slot->marker = (marker != NULL);
+
+		if (marker != NULL)
+			slot->blob = *marker;
+
+		slot->seq = ++debug_seq;
+		slot->state = DEBUG_READY;
+	}
+
+	pthread_mutex_unlock(&debug_mutex);
+
+	if (slot != NULL)
+		eventfd_write(debug_event_fd, 1);
+
+	*due = now + 1000 / cfg->debug_fps;
+}
+
+/* once the cameras have stopped */
+void debug_stream_free()
+{
+	int k;
+
+	for (k = 0; k < DEBUG_RING; k++)
+	{
+		cvReleaseImage(&debug_ring[k].image);
+		free(debug_ring[k].labels);
+		debug_ring[k].labels = NULL;
+	}
+}
+
+/*
+	Recordings. Each camera can record what it sees, with the sensor
+	readings and the decision of every frame, to a series of .rec files
+	of record-frames frames each. A file starts with a rec_file_header_t;
+	every frame follows as a rec_frame_header_t and its pixels, padded to
+	8 bytes so that a mapped file can be read in place, and a closed file
+	ends with an index of where each frame starts and a trailer pointing
+	at it. A file cut short by a crash has no index, but its frames are
+	still found by walking the headers.
+
+	The pixels of a row are stored as the difference to the pixel on
+	their left, Huffman-coded by zlib, which is lossless and keeps up
+	with a camera on one core; a frame that would not shrink is stored
+	as it is.
+*/
+#define REC_MAGIC		"TTYREC01"
+#define REC_FRAME_MAGIC		0x4D415246	/* "FRAM" */
+#define REC_INDEX_MAGIC		0x58444E49	/* "INDX" */
+
+#define REC_CODEC_STORE		0
+#define REC_CODEC_DELTA_HUFFMAN	1
+
+struct rec_file_header_s
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t camera;
+};
+typedef struct rec_file_header_s rec_file_header_t;
+
+struct rec_frame_header_s
+{
+	uint32_t magic;
+	uint32_t size;		/* bytes of pixel data that follow, before padding */
+	uint64_t time_ns;	/* CLOCK_MONOTONIC at capture */
+	uint32_t frame;		/* within the recording, gaps are dropped frames */
+	uint16_t width;
+	uint16_t height;
+	uint8_t channels;
+	uint8_t codec;
+	uint8_t speed;
+	uint8_t state;
+	uint8_t sensor[3];	/* indexed by SENSOR_LEFT... */
+	int8_t direction;	/* as published, see vehicle_s */
+	int16_t steering;	/* degrees */
+	uint16_t qualify;
+	uint32_t reserved;
+};
+typedef struct rec_frame_header_s rec_frame_header_t;
+
+struct rec_index_s
+{
+	uint64_t offset;
+	uint64_t time_ns;
+};
+typedef struct rec_index_s rec_index_t;
+
+struct rec_trailer_s
+{
+	uint64_t index_offset;
+	uint32_t count;
+	uint32_t magic;
+};
+typedef struct rec_trailer_s rec_trailer_t;
+
+#define REC_PAD(_size)		(((_size) + 7) & ~7)
+
+/* a recording mapped for replay */
+struct rec_file_s
+{
+	unsigned char* map;
+	size_t size;
+	rec_index_t* index;
+	int count;
+	int own_index;		/* rebuilt by walking the frames, not the file's */
+	unsigned char* buffer;	/* one decompressed frame */
+	int buffer_size;
+};
+typedef struct rec_file_s rec_file_t;
+
+void rec_close(rec_file_t* rec)
+{
+	if (rec->map != NULL)
+		munmap(rec->map, rec->size);
+
+	if (rec->own_index)
+		free(rec->index);
+
+	free(rec->buffer);
+	memset(rec, 0, sizeof(rec_file_t));
+}
+
+/* whether a frame header with all of its data lies at offset */
+int rec_frame_at(rec_file_t* rec, uint64_t offset)
+{
+	rec_frame_header_t* header;
+
+	if ((offset < sizeof(rec_file_header_t)) || (offset % 8 != 0) ||
+		(offset + sizeof(rec_frame_header_t) > rec->size))
+		return 0;
+
+	header = (rec_frame_header_t*) (rec->map + offset);
+
+	return (header->magic == REC_FRAME_MAGIC) && (offset + sizeof(rec_frame_header_t) + header->size <= rec->size);
+}
+
+/* maps a recording and finds its frames, -1 when it is not one */
+int rec_open(const char* path, rec_file_t* rec)
+{
+	rec_trailer_t* trailer;
+	rec_frame_header_t* header;
+	struct stat st;
+	uint64_t offset;
+	int max = 0;
+	int fd;
+	int k;
+
+	memset(rec, 0, sizeof(rec_file_t));
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+
+	if ((fstat(fd, &st) < 0) || (st.st_size < sizeof(rec_file_header_t)) ||
+		((rec->map = (unsigned char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED))
+	{
+		rec->map = NULL;
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	rec->size = st.st_size;
+
+	if (memcmp(rec->map, REC_MAGIC, 8) != 0)
+	{
+		rec_close(rec);
+		return -1;
+	}
+
+	trailer = (rec_trailer_t*) (rec->map + rec->size - sizeof(rec_trailer_t));
+
+	if ((rec->size >= sizeof(rec_file_header_t) + sizeof(rec_trailer_t)) &&
+		(trailer->magic == REC_INDEX_MAGIC) &&
+		(trailer->index_offset <= rec->size) &&
+		(trailer->index_offset + (uint64_t) trailer->count * sizeof(rec_index_t) + sizeof(rec_trailer_t) == rec->size))
+	{
+		rec->index = (rec_index_t*) (rec->map + trailer->index_offset);
+		rec->count = trailer->count;
+
+		/* the index is only a shortcut, its frames must hold up as well as walked ones */
+		for (k = 0; k < rec->count; k++)
+		{
+			if (!rec_frame_at(rec, rec->index[k].offset))
+				break;
+		}
+
+		if (k == rec->count)
+			return 0;
+
+		rec->index = NULL;
+		rec->count = 0;
+	}
+
+	/* no usable index, the writer never finished: walk the frames */
+	rec->own_index = 1;
+
+	for (offset = sizeof(rec_file_header_t); rec_frame_at(rec, offset);
+		offset += sizeof(rec_frame_header_t) + REC_PAD(header->size))
+	{
+		header = (rec_frame_header_t*) (rec->map + offset);
+
+		if (rec->count == max)
+		{
+			max = max ? 2 * max : 256;
+			rec->index = (rec_index_t*) realloc(rec->index, max * sizeof(rec_index_t));
+
+			if (rec->index == NULL)
+			{
+				rec_close(rec);
+				return -1;
+			}
+		}
+
+		rec->index[rec->count].offset = offset;
+		rec->index[rec->count].time_ns = header->time_ns;
+		rec->count++;
+	}
+
+	return 0;
+}
+
+int rec_is_recording(const char* path)
+{
+	size_t length = strlen(path);
+
+	return (length > 4) && (strcmp(path + length - 4, ".rec") == 0);
+}
+
+rec_frame_header_t* rec_header(rec_file_t* rec, int k)
+{
+	return (rec_frame_header_t*) (rec->map + rec->index[k].offset);
+}
+
+/* decodes frame k into *image, which is (re)created to fit; -1 when the frame is damaged */
+int rec_decode(rec_file_t* rec, int k, IplImage** image)
+{
+	rec_frame_header_t* header = rec_header(rec, k);
+	unsigned char* data = (unsigned char*) (header + 1);
+	unsigned char* row;
+	int width = header->width;
+	int height = header->height;
+	int channels = header->channels;
+	int row_size = width * channels;
+	uLongf size = (uLongf) row_size * height;
+	uLongf expected = size;
+	int x;
+	int y;
+
+	/* rec_open() vouched for the bytes, not for what they claim to be */
+	if ((width == 0) || (height == 0) || ((channels != 1) && (channels != 3) && (channels != 4)) ||
+		((header->codec != REC_CODEC_STORE) && (header->codec != REC_CODEC_DELTA_HUFFMAN)) ||
+		(size > INT_MAX))
+		return -1;
+
+	if ((*image == NULL) || ((*image)->width != width) || ((*image)->height != height) ||
+		((*image)->nChannels != channels))
+	{
+		cvReleaseImage(image);
+
+		if ((*image = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, channels)) == NULL)
+			return -1;
+	}
+
+	if (header->codec == REC_CODEC_DELTA_HUFFMAN)
+	{
+		if (rec->buffer_size < size)
+		{
+			free(rec->buffer);
+			rec->buffer_size = 0;
+
+			if ((rec->buffer = (unsigned char*) malloc(size)) == NULL)
+				return -1;
+
+			rec->buffer_size = size;
+		}
+
+		if ((uncompress(rec->buffer, &size, data, header->size) != Z_OK) || (size != expected))
+			return -1;
+
+		data = rec->buffer;
+	}
+	else if (header->size != size)
+	{
+		return -1;
+	}
+
+	for (y = 0; y < height; y++)
+	{
+		row = (unsigned char*) (*image)->imageData + y * (*image)->widthStep;
+		memcpy(row, data + y * row_size, row_size);
+
+		if (header->codec == REC_CODEC_DELTA_HUFFMAN)
+		{
+			for (x = channels; x < row_size; x++)
+				row[x] += row[x - channels];
+		}
+	}
+
+	return 0;
+}
+
+/*
+	Recorder of one camera. The camera fills a ring of record-buffers
+	slots, the writer thread empties it; neither ever waits for the
+	other, and a frame that finds the ring full is counted as dropped.
+	highgui reuses the captured image, so the camera copies each frame
+	once, into its slot, and the writer compresses it from there.
+*/
+struct record_slot_s
+{
+	unsigned char* data;		/* rows packed, without padding */
+	int capacity;
+	rec_frame_header_t header;
+};
+typedef struct record_slot_s record_slot_t;
+
+struct recorder_s
+{
+	camera_t* camera;
+	record_slot_t* slots;
+	int nslots;
+	unsigned long sequence;		/* frames the camera offered, recorded or not */
+	unsigned long head;		/* slots the camera filled */
+	unsigned long tail;		/* slots the writer emptied */
+	int event_fd;			/* counts the frames filled */
+	int closed;			/* the camera is gone, finish and stop */
+	pthread_t thread;
+
+	/* the writer's */
+	z_stream zs;
+	char stamp[16];			/* of the start, in the file names */
+	FILE* file;
+	int file_number;
+	uint64_t offset;
+	rec_index_t* index;
+	unsigned char* filtered;
+	unsigned char* packed;
+	int buffer_size;
+
+	/* metrics, see METRIC_ADD() */
+	unsigned long frames;
+	unsigned long dropped;
+	unsigned long bytes_raw;
+	unsigned long bytes_written;
+	unsigned long busy_ns;
+	uint64_t first_ns;
+	uint64_t last_ns;
+};
+typedef struct recorder_s recorder_t;
+
+static recorder_t recorders[MAX_CAMERAS];
+
+/* hands a frame and what came of it to the writer, without waiting */
+void recorder_push(recorder_t* recorder, IplImage* frame, struct timespec* captured,
+	decision_filter_t* filter, int qualify)
+{
+	unsigned long head = recorder->head;
+	vehicle_t* vehicle = recorder->camera->vehicle;
+	record_slot_t* slot;
+	rec_frame_header_t* header;
+	int row_size = frame->width * frame->nChannels;
+	int size = row_size * frame->height;
+	int k;
+	int y;
+
+	recorder->sequence++;
+
+	if (head - __atomic_load_n(&recorder->tail, __ATOMIC_ACQUIRE) >= recorder->nslots)
+	{
+		METRIC_ADD(recorder->dropped, 1);
+		return;
+	}
+
+	slot = &recorder->slots[head % recorder->nslots];
+
+	if (slot->capacity < size)
+	{
+		free(slot->data);
+		slot->capacity = 0;
+
+		if ((slot->data = (unsigned char*) malloc(size)) == NULL)
+		{
+			METRIC_ADD(recorder->dropped, 1);
+			return;
+		}
+
+		slot->capacity = size;
+	}
+
+	for (y = 0; y < frame->height; y++)
+		memcpy(slot->data + y * row_size, frame->imageData + y * frame->widthStep, row_size);
+
+	header = &slot->header;
+	memset(header, 0, sizeof(rec_frame_header_t));
+	header->magic = REC_FRAME_MAGIC;
+	header->time_ns = (uint64_t) captured->tv_sec * 1000000000ULL + captured->tv_nsec;
+	header->frame = recorder->sequence - 1;
+	header->width = frame->width;
+	header->height = frame->height;
+	header->channels = frame->nChannels;
+	header->speed = __atomic_load_n(&vehicle->speed, __ATOMIC_RELAXED);
+	header->state = __atomic_load_n(&vehicle->state, __ATOMIC_RELAXED);
+
+	for (k = 0; k < 3; k++)
+		header->sensor[k] = __atomic_load_n(&vehicle->sensor[k], __ATOMIC_RELAXED);
+
+	header->direction = filter->direction;
+	header->steering = (int) filter->steering;
+	header->qualify = qualify;
+
+	__atomic_store_n(&recorder->head, head + 1, __ATOMIC_RELEASE);
+	eventfd_write(recorder->event_fd, 1);
+}
+
+/* writes the index and the trailer, and closes the file */
+void recorder_finish_file(recorder_t* recorder)
+{
+	rec_trailer_t trailer;
+	int count = recorder->frames % cfg->record_frames;
+
+	if (recorder->file == NULL)
+		return;
+
+	if ((count == 0) && (recorder->frames > 0))
+		count = cfg->record_frames;
+
+	trailer.index_offset = recorder->offset;
+	trailer.count = count;
+	trailer.magic = REC_INDEX_MAGIC;
+
+	fwrite(recorder->index, sizeof(rec_index_t), count, recorder->file);
+	fwrite(&trailer, sizeof(trailer), 1, recorder->file);
+	METRIC_ADD(recorder->bytes_written, count * sizeof(rec_index_t) + sizeof(trailer));
+
+	if (fclose(recorder->file) != 0)
+		perror("record");
+
+	recorder->file = NULL;
+}
+
+int recorder_open_file(recorder_t* recorder)
+{
+	rec_file_header_t header;
+	char path[384];
+
+	snprintf(path, sizeof(path), "%s/camera%d-%s-%04d.rec", cfg->record,
+		recorder->camera->id, recorder->stamp, recorder->file_number++);
+
+	if ((recorder->file = fopen(path, "wb")) == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+
+	setvbuf(recorder->file, NULL, _IOFBF, 1 << 20);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, REC_MAGIC, 8);
+	header.version = 1;
+	header.camera = recorder->camera->id;
+
+	fwrite(&header, sizeof(header), 1, recorder->file);
+	recorder->offset = sizeof(header);
+	METRIC_ADD(recorder->bytes_written, sizeof(header));
+
+	return 0;
+}
+
+/* compresses one slot into the current file, -1 when the file cannot be written */
+int recorder_write(recorder_t* recorder, record_slot_t* slot)
+{
+	static const unsigned char padding[8] = { 0 };
+	rec_frame_header_t* header = &slot->header;
+	int channels = header->channels;
+	int row_size = header->width * channels;
+	int size = row_size * header->height;
+	unsigned char* src;
+	unsigned char* dst;
+	uLong bound = compressBound(size);
+	int x;
+	int y;
+
+	if (recorder->buffer_size < size)
+	{
+		free(recorder->filtered);
+		free(recorder->packed);
+		recorder->filtered = (unsigned char*) malloc(size);
+		recorder->packed = (unsigned char*) malloc(bound);
+		recorder->buffer_size = (recorder->filtered && recorder->packed) ? size : 0;
+
+		if (recorder->buffer_size == 0)
+			return -1;
+	}
+
+	/* each byte as the difference to the same channel of the pixel on its left */
+	for (y = 0; y < header->height; y++)
+	{
+		src = slot->data + y * row_size;
+		dst = recorder->filtered + y * row_size;
+		memcpy(dst, src, channels);
+
+		for (x = channels; x < row_size; x++)
+			dst[x] = src[x] - src[x - channels];
+	}
+
+	deflateReset(&recorder->zs);
+	recorder->zs.next_in = recorder->filtered;
+	recorder->zs.avail_in = size;
+	recorder->zs.next_out = recorder->packed;
+	recorder->zs.avail_out = bound;
+
+	if ((deflate(&recorder->zs, Z_FINISH) == Z_STREAM_END) && (recorder->zs.total_out < size))
+	{
+		header->codec = REC_CODEC_DELTA_HUFFMAN;
+		header->size = recorder->zs.total_out;
+		src = recorder->packed;
+	}
+	else
+	{
+		header->codec = REC_CODEC_STORE;
+		header->size = size;
+		src = slot->data;
+	}
+
+	if ((recorder->file == NULL) && (recorder_open_file(recorder) < 0))
+		return -1;
+
+	recorder->index[recorder->frames % cfg->record_frames].offset = recorder->offset;
+	recorder->index[recorder->frames % cfg->record_frames].time_ns = header->time_ns;
+
+	fwrite(header, sizeof(rec_frame_header_t), 1, recorder->file);
+	fwrite(src, 1, header->size, recorder->file);
+	fwrite(padding, 1, REC_PAD(header->size) - header->size, recorder->file);
+
+	if (ferror(recorder->file))
+		return -1;
+
+	recorder->offset += sizeof(rec_frame_header_t) + REC_PAD(header->size);
+
+	if (recorder->frames == 0)
+		recorder->first_ns = header->time_ns;
+
+	recorder->last_ns = header->time_ns;
+	METRIC_ADD(recorder->frames, 1);
+	METRIC_ADD(recorder->bytes_raw, size);
+	METRIC_ADD(recorder->bytes_written, sizeof(rec_frame_header_t) + REC_PAD(header->size));
+
+	if (recorder->frames % cfg->record_frames == 0)
+		recorder_finish_file(recorder);
+
+	return 0;
+}
+
+/* empties the ring of one camera into its files until the camera is gone */
+void* RecorderThreadProc(void* data)
+{
+	recorder_t* recorder = (recorder_t*) data;
+	struct timespec start;
+	struct timespec end;
+	unsigned long head;
+	eventfd_t frames;
+	double seconds;
+	int failed = 0;
+
+	for (;;)
+	{
+		/* the camera sets closed before its last wakeup */
+		eventfd_read(recorder->event_fd, &frames);
+		head = __atomic_load_n(&recorder->head, __ATOMIC_ACQUIRE);
+
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+		for (; recorder->tail != head; __atomic_store_n(&recorder->tail, recorder->tail + 1, __ATOMIC_RELEASE))
+		{
+			if (!failed && (recorder_write(recorder, &recorder->slots[recorder->tail % recorder->nslots]) < 0))
+			{
+				fprintf(stderr, "camera %d: recording failed, frames are dropped from now on\n",
+					recorder->camera->id);
+				failed = 1;
+			}
+
+			if (failed)
+				METRIC_ADD(recorder->dropped, 1);
+		}
+
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+		METRIC_ADD(recorder->busy_ns, timespec_diff_ns(&end, &start));
+
+		if (__atomic_load_n(&recorder->closed, __ATOMIC_ACQUIRE) &&
+			(__atomic_load_n(&recorder->head, __ATOMIC_ACQUIRE) == recorder->tail))
+			break;
+	}
+
+	recorder_finish_file(recorder);
+
+	seconds = (recorder->last_ns - recorder->first_ns) / 1e9;
+
+	printf("recorder %d: %lu frames, %.1f MB/s recorded, writer capacity %.1f MB/s, %.2f:1, %lu dropped\n",
+		recorder->camera->id, recorder->frames,
+		(seconds > 0) ? recorder->bytes_raw / seconds / 1e6 : 0.0,
+		recorder->busy_ns ? recorder->bytes_raw * 1000.0 / recorder->busy_ns : 0.0,
+		recorder->bytes_written ? (double) recorder->bytes_raw / recorder->bytes_written : 0.0,
+		recorder->dropped);
+
+	return NULL;
+}
+
+/* sets up the recorder of a camera, before the camera starts */
+int recorder_init(recorder_t* recorder, camera_t* camera)
+{
+	time_t now = time(NULL);
+
+	memset(recorder, 0, sizeof(recorder_t));
+	recorder->camera = camera;
+	recorder->nslots = cfg->record_buffers;
+	recorder->slots = (record_slot_t*) calloc(recorder->nslots, sizeof(record_slot_t));
+	recorder->index = (rec_index_t*) malloc(cfg->record_frames * sizeof(rec_index_t));
+	recorder->event_fd = eventfd(0, EFD_CLOEXEC);
+	strftime(recorder->stamp, sizeof(recorder->stamp), "%Y%m%d-%H%M%S", localtime(&now));
+
+	if (!recorder->slots || !recorder->index || (recorder->event_fd < 0) ||
+		(deflateInit2(&recorder->zs, Z_BEST_SPEED, Z_DEFLATED, 15, 8, Z_HUFFMAN_ONLY) != Z_OK))
+	{
+		free(recorder->slots);
+		free(recorder->index);
+
+		if (recorder->event_fd >= 0)
+			close(recorder->event_fd);
+
+		recorder->slots = NULL;
+		return -1;
+	}
+
+	camera->recorder = recorder;
+
+	return 0;
+}
+
+/* once the camera stopped: lets the writer finish, then frees everything */
+void recorder_stop(recorder_t* recorder)
+{
+	int k;
+
+	if (recorder->slots == NULL)
+		return;
+
+	__atomic_store_n(&recorder->closed, 1, __ATOMIC_RELEASE);
+	eventfd_write(recorder->event_fd, 1);
+	pthread_join(recorder->thread, NULL);
+
+	deflateEnd(&recorder->zs);
+	close(recorder->event_fd);
+
+	for (k = 0; k < recorder->nslots; k++)
+		free(recorder->slots[k].data);
+
+	free(recorder->slots);
+	free(recorder->index);
+	free(recorder->filtered);
+	free(recorder->packed);
+	recorder->slots = NULL;
+}
+
+/*
+	Paces the camera loop. Vision only steers while the controller is
+	giving orders, so the frame rate follows the commanded speed and
+	drops to an idle rate when the car is stopped, dancing or driven
+	by the Teensy on its own.
+*/
+struct frame_governor_s
+{
+	int camera;
+	vehicle_t* vehicle;	/* whose speed sets the rate */
+	struct timespec next;
+	int fps;
+	unsigned long frames;
+	unsigned long tiles;		/* classifier tiles since the last report */
+	unsigned long tiles_scanned;
+	struct timespec report_wall;
+	struct timespec report_cpu;
+};
+typedef struct frame_governor_s frame_governor_t;
+
+int vision_target_fps(vehicle_t* vehicle)
+{
+	if ((vehicle->state != STATE_ORDERS) || (vehicle->speed == 0))
+		return cfg->fps_idle;
+
+	return cfg->fps_min + ((cfg->fps_max - cfg->fps_min) * vehicle->speed) / 255;
+}
+
+void frame_governor_init(frame_governor_t* gov, int camera, vehicle_t* vehicle)
+{
+	memset(gov, 0, sizeof(frame_governor_t));
+	gov->camera = camera;
+	gov->vehicle = vehicle;
+	clock_gettime(CLOCK_MONOTONIC, &gov->next);
+	gov->report_wall = gov->next;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &gov->report_cpu);
+}
+
+/* sleeps until the next frame is due at the current target rate, returns 1 when stopping */
+int frame_governor_wait(frame_governor_t* gov)
+{
+	struct timespec now;
+	struct timespec timeout;
+	struct pollfd pfd;
+
+	gov->frames++;
+	gov->fps = vision_target_fps(gov->vehicle);
+
+	gov->next.tv_nsec += 1000000000L / gov->fps;
+
+	if (gov->next.tv_nsec >= 1000000000L)
+	{
+		gov->next.tv_sec++;
+		gov->next.tv_nsec -= 1000000000L;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* don't try to catch up on frames we were too slow for */
+	if ((now.tv_sec > gov->next.tv_sec) ||
+		((now.tv_sec == gov->next.tv_sec) && (now.tv_nsec > gov->next.tv_nsec)))
+	{
+		gov->next = now;
+		return stop_requested;
+	}
+
+	timeout.tv_sec = gov->next.tv_sec - now.tv_sec;
+	timeout.tv_nsec = gov->next.tv_nsec - now.tv_nsec;
+
+	if (timeout.tv_nsec < 0)
+	{
+		timeout.tv_sec--;
+		timeout.tv_nsec += 1000000000L;
+	}
+
+	pfd.fd = stop_fd;
+	pfd.events = POLLIN;
+	ppoll(&pfd, 1, &timeout, NULL);
+
+	return stop_requested;
+}
+
+/* prints frame rate and camera thread CPU share, at most once per interval */
+void frame_governor_report(frame_governor_t* gov)
+{
+	struct timespec wall;
+	struct timespec cpu;
+	long wall_ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	wall_ms = timespec_diff_ms(&wall, &gov->report_wall);
+
+	if (wall_ms < VISION_REPORT_INTERVAL)
+		return;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+
+	printf("vision %d: %.1f fps (target %d), cpu %.1f%%, %.0f%% of tiles unchanged\n",
+		gov->camera, (1000.0 * gov->frames) / wall_ms, gov->fps,
+		(100.0 * timespec_diff_ms(&cpu, &gov->report_cpu)) / wall_ms,
+		gov->tiles ? 100.0 * (gov->tiles - gov->tiles_scanned) / gov->tiles : 0.0);
+
+	gov->frames = 0;
+	gov->tiles = 0;
+	gov->tiles_scanned = 0;
+	gov->report_wall = wall;
+	gov->report_cpu = cpu;
+}
+
+void* CameraThreadProc(void* tdata)
+{
+    camera_t *camera = (camera_t*) tdata;
+    CvCapture *capture = 0;
+    IplImage *frame = 0;
+    rec_file_t replay = { 0 };
+    IplImage *replay_frame = 0;
+    int replay_next = 0;
+    frame_governor_t governor;
+    struct timespec t_start, t_captured, t_done;
+
+    int width; 
+    int status;
+    
+    unsigned long count_red; 
+    vision_t vision;
+    long debug_due = 0;
+    vision_params_t params;
+
+    vision_init(&vision);
+
+    /* initialize camera, or open the file it replays */
+    if (camera->index >= 0)
+        capture = cvCaptureFromCAM( camera->index );
+    else if (!rec_is_recording(camera->source))
+        capture = cvCaptureFromFile( camera->source );
+    else if (rec_open(camera->source, &replay) < 0)
+        fprintf( stderr, "%s: not a recording\n", camera->source );
+ 
+    /* always check */
+    if ( !capture && !replay.map ) {
+        fprintf( stderr, "Cannot open initialize webcam %d!\n", camera->id );
+        return NULL;
+    }
+
+    printf( "camera %d ready after %.1f ms\n", camera->id, startup_us() / 1000.0 );
+ 
+    /* create a window for the video */
+    // cvNamedWindow( "result", CV_WINDOW_AUTOSIZE );
+ 
+    frame_governor_init(&governor, camera->id, camera->vehicle);
+
+    while( !stop_requested ) {
+        /* get a frame */
+        clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+        if (replay.map == NULL)
+          frame = cvQueryFrame( capture );
+        else if ((replay_next < replay.count) && (rec_decode(&replay, replay_next++, &replay_frame) == 0))
+          frame = replay_frame;
+        else
+          frame = NULL;
+
+        clock_gettime(CLOCK_MONOTONIC, &t_captured);
+
+        /* always check */
+        if( !frame ) break;
+       
+        width = frame->width; 
+
+        /* pick up parameter changes made since the last frame */
+        vision_params_get(&params);
+
+        /* segments the frame and smooths what each section holds, exactly as --evaluate does */
+        status = vision_analyse(&vision, frame, &params);
+
+        if (status == VISION_NO_MEMORY) {
+          fprintf( stderr, "Cannot allocate column histogram!\n" );
+          break;
+        }
+
+        if (status == VISION_BAD_LAYOUT) {
+          fprintf( stderr, "camera %d: unsupported %d-channel frames!\n", camera->id, frame->nChannels );
+          break;
+        }
+
+        __atomic_store_n(&camera->qualify, vision.qualify, __ATOMIC_RELAXED);
+        governor.tiles += vision.classifier.tiles;
+        governor.tiles_scanned += vision.classifier.tiles_scanned;
+        METRIC_ADD(camera->tiles, vision.classifier.tiles);
+        METRIC_ADD(camera->tiles_scanned, vision.classifier.tiles_scanned);
+        color_classifier_sections(&vision.classifier, 3, camera->coverage);
+
+        count_red = column_hist_range(&vision.hist, 0, width);
+
+        // printf("countred: %d\n", count_red);
+
+        __atomic_store_n(&camera->blobs, vision.blobs.nblobs, __ATOMIC_RELAXED);
+        __atomic_store_n(&camera->marker_area, vision.marker ? vision.marker->area : 0, __ATOMIC_RELAXED);
+
+        /* the line goes out with every frame, the controller's loop runs at our rate */
+        if (cfg->line_follow) {
+          vision.line.captured = t_captured;
+          publish_line(camera, &vision.line);
+        }
+
+#ifdef DEBUGMODE
+
+        /*
+            When adding to the beagle board, you should
+            just set the global flag here so that the
+            thread edits said variable. 
+        */
+        vision_decide(&vision.filter, &params);
+
+        publish_decision(camera, vision.filter.direction, (int) vision.filter.steering);
+
+        /*printf
+        (
+          "x:%d,y:%d,[r%%:%f][r%%:%f][r%%:%f] : I want to go... %s    ", 
+          frame->width
+          ,frame->height
+          ,vision.filter.percent[0]
+          ,vision.filter.percent[1]
+          ,vision.filter.percent[2]
+          ,direction_name(vision.filter.direction)
+        );*/
+
+        frame_governor_report(&governor);
+
+#endif 
+        clock_gettime(CLOCK_MONOTONIC, &t_done);
+        METRIC_ADD(camera->frames, 1);
+        METRIC_ADD(camera->capture_ns, timespec_diff_ns(&t_captured, &t_start));
+        METRIC_ADD(camera->analysis_ns, timespec_diff_ns(&t_done, &t_captured));
+
+        if (camera->recorder)
+          recorder_push(camera->recorder, frame, &t_captured, &vision.filter, vision.qualify);
+
+        /* a window was too slow on the board, browsers watch a sample of the frames instead */
+        debug_stream_sample(camera, frame, &vision.classifier, &vision.filter,
+          direction_name(vision.filter.direction), vision.marker, params.color, vision.qualify, &debug_due);
+ 
+        /* wait for the next frame slot */
+        if (frame_governor_wait(&governor))
+          break;
+    }
+ 
+    /* a camera that stopped has no opinion any more */
+    publish_decision(camera, -2, 0);
+
+    if (cfg->line_follow)
+      publish_line(camera, NULL);
+
+    if (camera->tiles)
+      printf( "camera %d: %.1f%% of tiles unchanged and skipped\n", camera->id,
+        100.0 * (camera->tiles - camera->tiles_scanned) / camera->tiles );
+
+    /* free memory */
+    // cvDestroyWindow( "result" );
+    if (replay.map == NULL)
+      cvReleaseCapture( &capture );
+
+    rec_close(&replay);
+    cvReleaseImage(&replay_frame);
+    vision_free(&vision);
+
+    return NULL;
+}
+
+/*
+	Starts a thread pinned to the CPU of its config and, with --realtime,
+	under its scheduling policy and priority. When the kernel refuses
+	(usually missing CAP_SYS_NICE) it falls back to default attributes.
+*/
+int thread_create(pthread_t* thread, thread_config_t* config, void* (*proc)(void*), void* arg)
+{
+	pthread_attr_t attr;
+	struct sched_param param;
+	cpu_set_t cpuset;
+	int status;
+
+	pthread_attr_init(&attr);
+
+	if ((cfg->realtime || (config->policy == SCHED_IDLE)) && (config->policy != SCHED_OTHER))
+	{
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = config->priority;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, config->policy);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+
+	if (config->cpu >= 0)
+	{
+		CPU_ZERO(&cpuset);
+		CPU_SET(config->cpu, &cpuset);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+	}
+
+	status = pthread_create(thread, &attr, proc, arg);
+	pthread_attr_destroy(&attr);
+
+	if (status != 0)
+	{
+		fprintf(stderr, "cannot apply scheduling to %s thread: %s\n",
+			config->name, strerror(status));
+
+		status = pthread_create(thread, NULL, proc, arg);
+	}
+
+	if (status == 0)
+		pthread_setname_np(*thread, config->name);
+
+	return status;
+}
+
+/*
+	Cyclictest-style probe: wakes up every RT_PROBE_INTERVAL us on an
+	absolute deadline and records how late each wakeup was. It runs
+	with the config of the serial reader, so the report shows the
+	latency the control path can expect under the current load.
+*/
+void* RTProbeThreadProc(void* data)
+{
+	struct timespec next;
+	struct timespec now;
+	long latency;
+	long min = -1;
+	long max = 0;
+	long long total = 0;
+	int loop;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	/* a shutdown must not wait for the rest of the probe */
+	for (loop = 0; (loop < RT_PROBE_LOOPS) && !stop_requested; loop++)
+	{
+		next.tv_nsec += RT_PROBE_INTERVAL * 1000L;
+
+		if (next.tv_nsec >= 1000000000L)
+		{
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		latency = (now.tv_sec - next.tv_sec) * 1000000L +
+			(now.tv_nsec - next.tv_nsec) / 1000L;
+
+		if ((min < 0) || (latency < min))
+			min = latency;
+
+		if (latency > max)
+			max = latency;
+
+		total += latency;
+	}
+
+	if (loop == 0)
+		return NULL;
+
+	printf("rt probe (%s): %d wakeups, latency min %ld us, avg %lld us, max %ld us\n",
+		cfg->realtime ? "realtime" : "default scheduling", loop,
+		min, total / loop, max);
+
+	return NULL;
+}
+
+/* listens on a TCP port of the loopback interface */
+int loopback_listen(int port, const char* name)
+{
+	struct sockaddr_in in_addr;
+	int on = 1;
+	int fd;
+
+	memset(&in_addr, 0, sizeof(in_addr));
+	in_addr.sin_family = AF_INET;
+	in_addr.sin_port = htons(port);
+	in_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (fd >= 0)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	if ((fd < 0) || (bind(fd, (struct sockaddr*) &in_addr, sizeof(in_addr)) < 0) || (listen(fd, 4) < 0))
+	{
+		perror(name);
+
+		if (fd >= 0)
+			close(fd);
+
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+	Opens the metrics endpoint: a TCP port on the loopback interface,
+	or a unix socket when spec contains a '/'.
+*/
+int metrics_listen(const char* spec)
+{
+	struct sockaddr_un un_addr;
+	int fd;
+
+	if (strchr(spec, '/') != NULL)
+	{
+		if (strlen(spec) >= sizeof(un_addr.sun_path))
+			return -1;
+
+		memset(&un_addr, 0, sizeof(un_addr));
+		un_addr.sun_family = AF_UNIX;
+		strcpy(un_addr.sun_path, spec);
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		unlink(spec);
+
+		if ((fd < 0) || (bind(fd, (struct sockaddr*) &un_addr, sizeof(un_addr)) < 0))
+		{
+			perror("metrics");
+			return -1;
+		}
+
+		metrics_path = spec;
+	}
+	else
+	{
+		return loopback_listen(atoi(spec), "metrics");
+	}
+
+	if (listen(fd, 4) < 0)
+	{
+		perror("metrics");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+void metrics_thread_cpu(FILE* out, char* name, pthread_t thread)
+{
+	clockid_t clock;
+	struct timespec cpu;
+
+	if ((pthread_getcpuclockid(thread, &clock) != 0) || (clock_gettime(clock, &cpu) != 0))
+		return;
+
+	fprintf(out, "ttycmd_thread_cpu_seconds_total{thread=\"%s\"} %ld.%09ld\n",
+		name, (long) cpu.tv_sec, cpu.tv_nsec);
+}
+
+/* writes every metric in the Prometheus text format */
+void metrics_write(FILE* out)
+{
+	struct timespec now;
+	char name[16];
+	int section;
+	int c;
+	int k;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	fprintf(out, "# TYPE ttycmd_uptime_seconds gauge\n");
+	fprintf(out, "ttycmd_uptime_seconds %.3f\n", timespec_diff_ms(&now, &start_time) / 1000.0);
+
+	fprintf(out, "# TYPE ttycmd_serial_bytes_total counter\n");
+	fprintf(out, "ttycmd_serial_bytes_total{direction=\"in\"} %lu\n", METRIC_GET(metrics.serial_bytes_in));
+	fprintf(out, "ttycmd_serial_bytes_total{direction=\"out\"} %lu\n", METRIC_GET(metrics.serial_bytes_out));
+	fprintf(out, "# TYPE ttycmd_serial_writes_total counter\n");
+	fprintf(out, "ttycmd_serial_writes_total %lu\n", METRIC_GET(metrics.serial_writes));
+	fprintf(out, "# TYPE ttycmd_commands_sent_total counter\n");
+	fprintf(out, "ttycmd_commands_sent_total %lu\n", METRIC_GET(metrics.commands_sent));
+
+	fprintf(out, "# TYPE ttycmd_parse_errors_total counter\n");
+	fprintf(out, "ttycmd_parse_errors_total{source=\"serial\"} %lu\n", METRIC_GET(metrics.serial_errors));
+	fprintf(out, "ttycmd_parse_errors_total{source=\"repl\"} %lu\n", METRIC_GET(metrics.repl_errors));
+
+	fprintf(out, "# TYPE ttycmd_telemetry_reports_total counter\n");
+	fprintf(out, "ttycmd_telemetry_reports_total{result=\"sent\"} %lu\n", METRIC_GET(metrics.telemetry_sent));
+	fprintf(out, "ttycmd_telemetry_reports_total{result=\"failed\"} %lu\n", METRIC_GET(metrics.telemetry_failed));
+
+	if (METRIC_GET(first_command_us) >= 0)
+	{
+		fprintf(out, "# TYPE ttycmd_first_command_seconds gauge\n");
+		fprintf(out, "ttycmd_first_command_seconds %.6f\n", METRIC_GET(first_command_us) / 1e6);
+	}
+
+	fprintf(out, "# TYPE ttycmd_sensor_stale gauge\n");
+
+	for (k = 0; k < nvehicles; k++)
+		fprintf(out, "ttycmd_sensor_stale{vehicle=\"%d\"} %d\n",
+			k, __atomic_load_n(&vehicles[k].sensor_stale, __ATOMIC_RELAXED));
+
+	fprintf(out, "# TYPE ttycmd_camera_frames_total counter\n");
+
+	for (k = 0; k < ncameras; k++)
+		fprintf(out, "ttycmd_camera_frames_total{camera=\"%d\"} %lu\n", k, METRIC_GET(cameras[k].frames));
+
+	fprintf(out, "# TYPE ttycmd_camera_stage_seconds summary\n");
+
+	for (k = 0; k < ncameras; k++)
+	{
+		fprintf(out, "ttycmd_camera_stage_seconds_sum{camera=\"%d\",stage=\"capture\"} %.6f\n",
+			k, METRIC_GET(cameras[k].capture_ns) / 1e9);
+		fprintf(out, "ttycmd_camera_stage_seconds_count{camera=\"%d\",stage=\"capture\"} %lu\n",
+			k, METRIC_GET(cameras[k].frames));
+		fprintf(out, "ttycmd_camera_stage_seconds_sum{camera=\"%d\",stage=\"analysis\"} %.6f\n",
+			k, METRIC_GET(cameras[k].analysis_ns) / 1e9);
+		fprintf(out, "ttycmd_camera_stage_seconds_count{camera=\"%d\",stage=\"analysis\"} %lu\n",
+			k, METRIC_GET(cameras[k].frames));
+	}
+
+	fprintf(out, "# TYPE ttycmd_camera_coverage_ratio gauge\n");
+
+	for (k = 0; k < ncameras; k++)
+	{
+		for (c = 0; c < COLOR_CLASSES; c++)
+		{
+			for (section = 0; section < 3; section++)
+			{
+				fprintf(out, "ttycmd_camera_coverage_ratio{camera=\"%d\",color=\"%s\",section=\"%d\"} %.3f\n",
+					k, get_color_name(c), section,
+					__atomic_load_n(&cameras[k].coverage[c][section], __ATOMIC_RELAXED) / 1000.0);
+			}
+		}
+	}
+
+	fprintf(out, "# TYPE ttycmd_camera_tiles_total counter\n");
+
+	for (k = 0; k < ncameras; k++)
+	{
+		fprintf(out, "ttycmd_camera_tiles_total{camera=\"%d\",result=\"scanned\"} %lu\n",
+			k, METRIC_GET(cameras[k].tiles_scanned));
+		fprintf(out, "ttycmd_camera_tiles_total{camera=\"%d\",result=\"skipped\"} %lu\n",
+			k, METRIC_GET(cameras[k].tiles) - METRIC_GET(cameras[k].tiles_scanned));
+	}
+
+	fprintf(out, "# TYPE ttycmd_camera_blobs gauge\n");
+
+	for (k = 0; k < ncameras; k++)
+		fprintf(out, "ttycmd_camera_blobs{camera=\"%d\"} %d\n", k, METRIC_GET(cameras[k].blobs));
+
+	fprintf(out, "# TYPE ttycmd_camera_marker_pixels gauge\n");
+
+	for (k = 0; k < ncameras; k++)
+		fprintf(out, "ttycmd_camera_marker_pixels{camera=\"%d\"} %lu\n", k, METRIC_GET(cameras[k].marker_area));
+
+	fprintf(out, "# TYPE ttycmd_camera_qualify_threshold gauge\n");
+
+	for (k = 0; k < ncameras; k++)
+		fprintf(out, "ttycmd_camera_qualify_threshold{camera=\"%d\"} %d\n", k, METRIC_GET(cameras[k].qualify));
+
+	fprintf(out, "# TYPE ttycmd_recorder_frames_total counter\n");
+
+	for (k = 0; k < ncameras; k++)
+	{
+		if (cameras[k].recorder == NULL)
+			continue;
+
+		fprintf(out, "ttycmd_recorder_frames_total{camera=\"%d\",result=\"written\"} %lu\n", k,
+			METRIC_GET(cameras[k].recorder->frames));
+		fprintf(out, "ttycmd_recorder_frames_total{camera=\"%d\",result=\"dropped\"} %lu\n", k,
+			METRIC_GET(cameras[k].recorder->dropped));
+	}
+
+	fprintf(out, "# TYPE ttycmd_recorder_bytes_total counter\n");
+
+	for (k = 0; k < ncameras; k++)
+	{
+		if (cameras[k].recorder == NULL)
+			continue;
+
+		fprintf(out, "ttycmd_recorder_bytes_total{camera=\"%d\",stage=\"raw\"} %lu\n", k,
+			METRIC_GET(cameras[k].recorder->bytes_raw));
+		fprintf(out, "ttycmd_recorder_bytes_total{camera=\"%d\",stage=\"written\"} %lu\n", k,
+			METRIC_GET(cameras[k].recorder->bytes_written));
+	}
+
+	fprintf(out, "# TYPE ttycmd_thread_cpu_seconds_total counter\n");
+
+	if (event_loop)
+	{
+		metrics_thread_cpu(out, "reactor", main_thread);
+	}
+	else
+	{
+		metrics_thread_cpu(out, "cmd", cmd_thread);
+		metrics_thread_cpu(out, "bt", bt_thread);
+		metrics_thread_cpu(out, "watchdog", watchdog_thread);
+
+		for (k = 0; k < nvehicles; k++)
+		{
+			snprintf(name, sizeof(name), "comm%d", k);
+			metrics_thread_cpu(out, name, vehicles[k].comm_thread);
+			snprintf(name, sizeof(name), "intel%d", k);
+			metrics_thread_cpu(out, name, vehicles[k].intel_thread);
+		}
+	}
+
+	for (k = 0; k < ncameras; k++)
+	{
+		snprintf(name, sizeof(name), "camera%d", k);
+		metrics_thread_cpu(out, name, cameras[k].thread);
+
+		if (cameras[k].recorder)
+		{
+			snprintf(name, sizeof(name), "record%d", k);
+			metrics_thread_cpu(out, name, cameras[k].recorder->thread);
+		}
+	}
+
+	metrics_thread_cpu(out, "metrics", pthread_self());
+}
+
+/* answers every request on the endpoint with the current metrics */
+void* MetricsThreadProc(void* data)
+{
+	char request[1024];
+	FILE* out;
+	int client;
+
+	while (!stop_wait(metrics_fd, POLLIN, -1))
+	{
+		client = accept4(metrics_fd, NULL, NULL, SOCK_CLOEXEC);
+
+		if (client < 0)
+			continue;
+
+		/* the path does not matter, but let the request arrive first */
+		if (stop_wait(client, POLLIN, 1000) || (read(client, request, sizeof(request)) <= 0) ||
+			((out = fdopen(client, "w")) == NULL))
+		{
+			close(client);
+			continue;
+		}
+
+		fprintf(out, "HTTP/1.0 200 OK\r\n");
+		fprintf(out, "Content-Type: text/plain; version=0.0.4\r\n");
+		fprintf(out, "Connection: close\r\n\r\n");
+		metrics_write(out);
+		fclose(out);
+	}
+
+	return NULL;
+}
+
+/* draws what the camera made of the frame over a BGR copy of it */
+void debug_stream_draw(debug_frame_t* slot, IplImage* canvas)
+{
+	unsigned char bit = 1 << slot->color;
+	unsigned char* label = slot->labels;
+	unsigned char* pixel;
+	double angle = slot->steering * M_PI / 180.0;
+	char text[96];
+	CvFont font;
+	int width = canvas->width;
+	int height = canvas->height;
+	int x;
+	int y;
+
+	if (slot->image->nChannels == 3)
+		cvCopy(slot->image, canvas, NULL);
+	else
+		cvCvtColor(slot->image, canvas, (slot->image->nChannels == 1) ? CV_GRAY2BGR : CV_BGRA2BGR);
+
+	/* the target colour's mask, tinted magenta */
+	for (y = 0; y < height; y++)
+	{
+		pixel = (unsigned char*) canvas->imageData + y * canvas->widthStep;
+
+		for (x = 0; x < width; x++, pixel += 3, label++)
+		{
+			if (*label & bit)
+			{
+				pixel[0] = (pixel[0] + 255) / 2;
+				pixel[1] = pixel[1] / 2;
+				pixel[2] = (pixel[2] + 255) / 2;
+			}
+		}
+	}
+
+	cvLine(canvas, cvPoint(width / 3, 0), cvPoint(width / 3, height - 1), CV_RGB(255, 255, 0), 1, 8, 0);
+	cvLine(canvas, cvPoint(2 * width / 3, 0), cvPoint(2 * width / 3, height - 1), CV_RGB(255, 255, 0), 1, 8, 0);
+
+	if (slot->marker)
+	{
+		cvRectangle(canvas, cvPoint(slot->blob.x0, slot->blob.y0), cvPoint(slot->blob.x1, slot->blob.y1),
+			CV_RGB(0, 255, 0), 2, 8, 0);
+	}
+
+	/* the steering angle, from the bottom centre */
+	cvLine(canvas, cvPoint(width / 2, height - 1),
+		cvPoint(width / 2 + (int) (sin(angle) * height / 3), height - 1 - (int) (cos(angle) * height / 3)),
+		CV_RGB(255, 0, 0), 2, 8, 0);
+
+	snprintf(text, sizeof(text), "camera %d %s %.0f%% %.0f%% %.0f%% steer %d qualify %d",
+		slot->camera, slot->direction, slot->percent[0], slot->percent[1], slot->percent[2],
+		slot->steering, slot->qualify);
+	cvInitFont(&font, CV_FONT_HERSHEY_SIMPLEX, 0.5, 0.5, 0, 1, 8);
+	cvPutText(canvas, text, cvPoint(8, 20), &font, CV_RGB(255, 255, 255));
+}
+
+/* sends one part of the multipart response, -1 when the client is gone or too slow */
+int debug_stream_send(int fd, CvMat* jpeg)
+{
+	char header[128];
+	int size = jpeg->rows * jpeg->cols;
+	int length;
+
+	length = snprintf(header, sizeof(header),
+		"--frame\r\nContent-Type: image/jpeg\r\nContent-Length: %d\r\n\r\n", size);
+
+	if ((send(fd, header, length, MSG_NOSIGNAL) != length) ||
+		(send(fd, jpeg->data.ptr, size, MSG_NOSIGNAL) != size) ||
+		(send(fd, "\r\n", 2, MSG_NOSIGNAL) != 2))
+		return -1;
+
+	return 0;
+}
+
+/*
+	Answers the request of a client accepted by DebugStreamThreadProc(),
+	who names the camera to watch in the path. Returns the camera, -1
+	when the client is turned away and DEBUG_PENDING while its request
+	has yet to arrive.
+*/
+int debug_stream_answer(int client)
+{
+	static const char header[] = "HTTP/1.0 200 OK\r\n"
+		"Content-Type: multipart/x-mixed-replace; boundary=frame\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Connection: close\r\n\r\n";
+	static const char not_found[] = "HTTP/1.0 404 Not Found\r\nConnection: close\r\n\r\n";
+	struct timeval timeout = { 0, 500000 };
+	char request[1024];
+	int length;
+	int camera;
+
+	if ((length = read(client, request, sizeof(request) - 1)) < 0)
+		return ((errno == EAGAIN) || (errno == EINTR)) ? DEBUG_PENDING : -1;
+
+	if (length == 0)
+		return -1;
+
+	request[length] = '\0';
+	camera = (strncmp(request, "GET /", 5) == 0) ? atoi(request + 5) : -1;
+
+	/* frames go out whole, a client that stops reading only holds up the stream for so long */
+	fcntl(client, F_SETFL, fcntl(client, F_GETFL) & ~O_NONBLOCK);
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	if ((camera < 0) || (camera >= ncameras))
+	{
+		send(client, not_found, sizeof(not_found) - 1, MSG_NOSIGNAL);
+		return -1;
+	}
+
+	if (send(client, header, sizeof(header) - 1, MSG_NOSIGNAL) != sizeof(header) - 1)
+		return -1;
+
+	return camera;
+}
+
+/* encodes the samples of the ring and streams them to the clients of their camera */
+void* DebugStreamThreadProc(void* data)
+{
+	static const int jpeg_params[] = { CV_IMWRITE_JPEG_QUALITY, DEBUG_JPEG_QUALITY, 0 };
+	struct pollfd pfd[3 + DEBUG_MAX_CLIENTS];
+	int clients[DEBUG_MAX_CLIENTS];
+	int client_camera[DEBUG_MAX_CLIENTS];
+	long client_deadline[DEBUG_MAX_CLIENTS];
+	int nclients = 0;
+	debug_frame_t* slot;
+	IplImage* canvas = NULL;
+	CvMat* jpeg;
+	eventfd_t samples;
+	char buffer[256];
+	long now;
+	int timeout;
+	int camera;
+	int client;
+	int k;
+
+	while (!stop_requested)
+	{
+		pfd[0].fd = stop_fd;
+		pfd[1].fd = debug_fd;
+		pfd[2].fd = debug_event_fd;
+
+		/* a request arriving, or a browser going away, makes a client's socket readable */
+		for (k = 0; k < nclients; k++)
+			pfd[3 + k].fd = clients[k];
+
+		for (k = 0; k < 3 + nclients; k++)
+			pfd[k].events = POLLIN;
+
+		/* wake up for the first client whose request is overdue */
+		timeout = -1;
+		now = monotonic_ms();
+
+		for (k = 0; k < nclients; k++)
+		{
+			if ((client_camera[k] == DEBUG_PENDING) && ((timeout < 0) || (client_deadline[k] - now < timeout)))
+				timeout = (client_deadline[k] > now) ? client_deadline[k] - now : 0;
+		}
+
+		if (poll(pfd, 3 + nclients, timeout) < 0)
+			continue;
+
+		if (stop_requested)
+			break;
+
+		now = monotonic_ms();
+
+		for (k = nclients - 1; k >= 0; k--)
+		{
+			if (client_camera[k] == DEBUG_PENDING)
+			{
+				camera = pfd[3 + k].revents ? debug_stream_answer(clients[k]) : DEBUG_PENDING;
+
+				if ((camera == DEBUG_PENDING) && (now < client_deadline[k]))
+					continue;
+
+				if (camera >= 0)
+				{
+					client_camera[k] = camera;
+					__atomic_add_fetch(&debug_watchers[camera], 1, __ATOMIC_RELAXED);
+					continue;
+				}
+			}
+			else if (!pfd[3 + k].revents || (read(clients[k], buffer, sizeof(buffer)) > 0))
+			{
+				continue;
+			}
+			else
+			{
+				__atomic_sub_fetch(&debug_watchers[client_camera[k]], 1, __ATOMIC_RELAXED);
+			}
+
+			close(clients[k]);
+			clients[k] = clients[--nclients];
+			client_camera[k] = client_camera[nclients];
+			client_deadline[k] = client_deadline[nclients];
+		}
+
+		/* the request is read once the socket says it has arrived, never waited for here */
+		if ((pfd[1].revents & POLLIN) &&
+			((client = accept4(debug_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0))
+		{
+			if (nclients == DEBUG_MAX_CLIENTS)
+			{
+				close(client);
+			}
+			else
+			{
+				clients[nclients] = client;
+				client_camera[nclients] = DEBUG_PENDING;
+				client_deadline[nclients++] = now + DEBUG_REQUEST_TIMEOUT;
+			}
+		}
+
+		if (!(pfd[2].revents & POLLIN))
+			continue;
+
+		eventfd_read(debug_event_fd, &samples);
+
+		/* the samples in the order they were taken */
+		for (;;)
+		{
+			pthread_mutex_lock(&debug_mutex);
+			slot = NULL;
+
+			for (k = 0; k < DEBUG_RING; k++)
+			{
+				if ((debug_ring[k].state == DEBUG_READY) && ((slot == NULL) || (debug_ring[k].seq < slot->seq)))
+					slot = &debug_ring[k];
+			}
+
+			if (slot != NULL)
+				slot->state = DEBUG_ENCODING;
+
+			pthread_mutex_unlock(&debug_mutex);
+
+			if (slot == NULL)
+				break;
+
+			if ((canvas == NULL) || (canvas->width != slot->image->width) || (canvas->height != slot->image->height))
+			{
+				cvReleaseImage(&canvas);
+				canvas = cvCreateImage(cvSize(slot->image->width, slot->image->height), IPL_DEPTH_8U, 3);
+			}
+
+			jpeg = NULL;
+
+			if (canvas != NULL)
+			{
+				debug_stream_draw(slot, canvas);
+				jpeg = cvEncodeImage(".jpg", canvas, jpeg_params);
+			}
+
+			camera = slot->camera;
+
+			pthread_mutex_lock(&debug_mutex);
+			slot->state = DEBUG_FREE;
+			pthread_mutex_unlock(&debug_mutex);
+
+			if (jpeg == NULL)
+				continue;
+
+			for (k = nclients - 1; k >= 0; k--)
+			{
+				if ((client_camera[k] == camera) && (debug_stream_send(clients[k], jpeg) < 0))
+				{
+					close(clients[k]);
+					__atomic_sub_fetch(&debug_watchers[camera], 1, __ATOMIC_RELAXED);
+					clients[k] = clients[--nclients];
+					client_camera[k] = client_camera[nclients];
+					client_deadline[k] = client_deadline[nclients];
+				}
+			}
+
+			cvReleaseMat(&jpeg);
+		}
+	}
+
+	for (k = 0; k < nclients; k++)
+		close(clients[k]);
+
+	cvReleaseImage(&canvas);
+
+	return NULL;
+}
+
+/*
+	Second startup stage, off the path to the first command. Locking
+	memory, opening cameras and connecting to the dongle can each take
+	from milliseconds to seconds, so they happen here while the serial
+	link, the REPL and the controller are already running.
+*/
+void* InitThreadProc(void* data)
+{
+	thread_config_t camera_config;
+	pthread_t probe_thread;
+	int k;
+
+	/* keep page faults out of the control path from now on */
+	if (cfg->realtime && (mlockall(MCL_CURRENT | MCL_FUTURE) < 0))
+		perror("mlockall");
+
+	/* the writers first, a camera records from its first frame */
+	for (k = 0; (k < ncameras) && cfg->record[0]; k++)
+	{
+		if (recorder_init(&recorders[k], &cameras[k]) < 0)
+			fprintf(stderr, "camera %d: cannot record\n", k);
+		else
+			thread_create(&recorders[k].thread, &thread_configs[THREAD_RECORD], RecorderThreadProc, &recorders[k]);
+	}
+
+	for (k = 0; k < ncameras; k++)
+	{
+		camera_config = thread_configs[THREAD_CAMERA];
+
+		if (cameras[k].cpu >= 0)
+			camera_config.cpu = cameras[k].cpu;
+
+		thread_create(&cameras[k].thread, &camera_config, CameraThreadProc, &cameras[k]);
+	}
+
+	/* the reactors run telemetry on their own timer */
+	if (!event_loop)
+		thread_create(&bt_thread, &thread_configs[THREAD_BT], BTThreadProc, NULL);
+
+	if (debug_fd >= 0)
+		thread_create(&debug_thread, &thread_configs[THREAD_DEBUG], DebugStreamThreadProc, NULL);
+
+	/* started last, it reads the clocks of all the other threads */
+	if (metrics_fd >= 0)
+		thread_create(&metrics_thread, &thread_configs[THREAD_METRICS], MetricsThreadProc, NULL);
+
+	printf("all subsystems started after %.1f ms\n", startup_us() / 1000.0);
+
+	/* measured while the other threads are already running */
+	if (cfg->rt_probe)
+	{
+		thread_create(&probe_thread, &thread_configs[THREAD_COMM], RTProbeThreadProc, NULL);
+		pthread_join(probe_thread, NULL);
+	}
+
+	return NULL;
+}
+
+/* sets up the next car on an open serial link */
+vehicle_t* add_vehicle(int fd)
+{
+	pthread_mutexattr_t attr;
+	vehicle_t* vehicle;
+
+	if (nvehicles >= MAX_VEHICLES)
+		return NULL;
+
+	vehicle = &vehicles[nvehicles];
+	memset(vehicle, 0, sizeof(vehicle_t));
+	vehicle->id = nvehicles;
+	vehicle->tty_fd = fd;
+	vehicle->intel_timer = -1;
+	vehicle->sensor_stale = 1;
+	vehicle->intel_phase = INTEL_START;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&vehicle->tty_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	nvehicles++;
+
+	return vehicle;
+}
+
+/*
+	Adds a camera from a "<source>[@<cpu>][:<car>]" spec, where source
+	is a device index or the path of a video file to replay, and car
+	the vehicle it steers, counting the devices from 0.
+*/
+int add_camera(char* spec)
+{
+	char* p;
+	camera_t* camera;
+	int car = 0;
+
+	if (ncameras >= MAX_CAMERAS)
+		return -1;
+
+	p = strrchr(spec, ':');
+
+	if (p != NULL)
+	{
+		*p = '\0';
+		car = atoi(p + 1);
+	}
+
+	if ((car < 0) || (car >= nvehicles))
+		return -1;
+
+	camera = &cameras[ncameras];
+	memset(camera, 0, sizeof(camera_t));
+	camera->id = ncameras;
+	camera->vehicle = &vehicles[car];
+	camera->cpu = -1;
+	camera->direction = -2;
+
+	p = strrchr(spec, '@');
+
+	if (p != NULL)
+	{
+		*p = '\0';
+		camera->cpu = atoi(p + 1);
+	}
+
+	if (spec[0] != '\0' && strspn(spec, "0123456789") == strlen(spec))
+	{
+		camera->index = atoi(spec);
+	}
+	else
+	{
+		camera->index = -1;
+		camera->source = spec;
+	}
+
+	ncameras++;
+
+	return 0;
+}
+
+/*
+	Options of the config file, where they are written "<name> = <value>",
+	and of the command line, where they are "--<name>=<value>". Flags
+	can leave out the value to mean yes. Numbers are range checked.
+*/
+#define CONFIG_INT		0
+#define CONFIG_DOUBLE		1
+#define CONFIG_FLAG		2
+#define CONFIG_STRING		3
+#define CONFIG_BDADDR		4
+#define CONFIG_COLOR		5
+#define CONFIG_IO		6
+#define CONFIG_CAMERA		7
+#define CONFIG_DEVICE		8
+#define CONFIG_THRESHOLD	9
+
+struct config_option_s
+{
+	char* name;
+	int type;
+	size_t offset;
+	double min;		/* numbers only */
+	double max;		/* numbers only, size of the buffer for strings */
+};
+typedef struct config_option_s config_option_t;
+
+#define CONFIG_FIELD(_field)	offsetof(config_t, _field)
+#define CONFIG_SIZE(_field)	sizeof(((config_t*) 0)->_field)
+
+static config_option_t config_options[] =
+{
+	{ "device", CONFIG_DEVICE, CONFIG_FIELD(device), 0, CONFIG_SIZE(device[0]) },
+	{ "baud", CONFIG_INT, CONFIG_FIELD(baud), 1200, 115200 },
+	{ "telemetry-address", CONFIG_BDADDR, CONFIG_FIELD(telemetry_address), 0, CONFIG_SIZE(telemetry_address) },
+	{ "telemetry-psm", CONFIG_INT, CONFIG_FIELD(telemetry_psm), 1, 0xFFFF },
+	{ "telemetry-interval", CONFIG_INT, CONFIG_FIELD(telemetry_interval), 10, 60000 },
+	{ "sensor-deadline", CONFIG_INT, CONFIG_FIELD(sensor_deadline), WATCHDOG_PERIOD, 10000 },
+	{ "backup-distance", CONFIG_INT, CONFIG_FIELD(backup_distance), 0, 255 },
+	{ "avoid-distance", CONFIG_INT, CONFIG_FIELD(avoid_distance), 0, 255 },
+	{ "cruise-speed", CONFIG_INT, CONFIG_FIELD(cruise_speed), 0, 255 },
+	{ "backup-time", CONFIG_INT, CONFIG_FIELD(backup_time), 0, 60000 },
+	{ "dance-time", CONFIG_INT, CONFIG_FIELD(dance_time), 0, 60000 },
+	{ "color", CONFIG_COLOR, CONFIG_FIELD(color), 0, 0 },
+	{ "qualify-threshold", CONFIG_INT, CONFIG_FIELD(qualify), 0, 255 },
+	{ "victory-threshold", CONFIG_INT, CONFIG_FIELD(victory), 0, 100 },
+	{ "direction-threshold", CONFIG_INT, CONFIG_FIELD(direction), 0, 100 },
+	{ "camera-fov", CONFIG_INT, CONFIG_FIELD(camera_fov), 2, 178 },
+	{ "steer-deadband", CONFIG_INT, CONFIG_FIELD(steer_deadband), 0, 90 },
+	{ "steer-hard-angle", CONFIG_INT, CONFIG_FIELD(steer_hard_angle), 0, 90 },
+	{ "decision-smoothing", CONFIG_DOUBLE, CONFIG_FIELD(decision_smoothing), 0.01, 1 },
+	{ "decision-hysteresis", CONFIG_INT, CONFIG_FIELD(decision_hysteresis), 0, 50 },
+	{ "steer-publish-delta", CONFIG_INT, CONFIG_FIELD(steer_publish_delta), 0, 90 },
+	{ "fps-max", CONFIG_INT, CONFIG_FIELD(fps_max), 1, 120 },
+	{ "fps-min", CONFIG_INT, CONFIG_FIELD(fps_min), 1, 120 },
+	{ "fps-idle", CONFIG_INT, CONFIG_FIELD(fps_idle), 1, 120 },
+	{ "change-threshold", CONFIG_INT, CONFIG_FIELD(change_threshold), 0, 255 },
+	{ "rescan-interval", CONFIG_INT, CONFIG_FIELD(rescan_interval), 1, 100000 },
+	{ "threshold", CONFIG_THRESHOLD, CONFIG_FIELD(threshold), 0, 0 },
+	{ "threshold-percentile", CONFIG_INT, CONFIG_FIELD(threshold_percentile), 1, 99 },
+	{ "threshold-smoothing", CONFIG_DOUBLE, CONFIG_FIELD(threshold_smoothing), 0.01, 1 },
+	{ "line-follow", CONFIG_FLAG, CONFIG_FIELD(line_follow), 0, 0 },
+	{ "line-kp", CONFIG_DOUBLE, CONFIG_FIELD(line_kp), 0, 100 },
+	{ "line-ki", CONFIG_DOUBLE, CONFIG_FIELD(line_ki), 0, 100 },
+	{ "line-kd", CONFIG_DOUBLE, CONFIG_FIELD(line_kd), 0, 100 },
+	{ "calibration", CONFIG_STRING, CONFIG_FIELD(calibration), 0, CONFIG_SIZE(calibration) },
+	{ "debug-stream", CONFIG_INT, CONFIG_FIELD(debug_stream), 0, 65535 },
+	{ "debug-fps", CONFIG_INT, CONFIG_FIELD(debug_fps), 1, 30 },
+	{ "record", CONFIG_STRING, CONFIG_FIELD(record), 0, CONFIG_SIZE(record) },
+	{ "record-frames", CONFIG_INT, CONFIG_FIELD(record_frames), 1, 100000 },
+	{ "record-buffers", CONFIG_INT, CONFIG_FIELD(record_buffers), 2, 1024 },
+	{ "self-aware-mode", CONFIG_FLAG, CONFIG_FIELD(self_aware), 0, 0 },
+	{ "realtime", CONFIG_FLAG, CONFIG_FIELD(realtime), 0, 0 },
+	{ "io", CONFIG_IO, CONFIG_FIELD(io), 0, 0 },
+	{ "rt-probe", CONFIG_FLAG, CONFIG_FIELD(rt_probe), 0, 0 },
+	{ "metrics", CONFIG_STRING, CONFIG_FIELD(metrics), 0, CONFIG_SIZE(metrics) },
+	{ "camera", CONFIG_CAMERA, CONFIG_FIELD(camera), 0, CONFIG_SIZE(camera[0]) }
+};
+
+pair_t io_modes[] =
+{
+	{ IO_THREADS, "threads" },
+	{ IO_EPOLL, "epoll" },
+	{ IO_URING, "io_uring" }
+};
+
+pair_t threshold_modes[] =
+{
+	{ THRESHOLD_FIXED, "fixed" },
+	{ THRESHOLD_OTSU, "otsu" },
+	{ THRESHOLD_PERCENTILE, "percentile" }
+};
+
+pair_t flag_values[] =
+{
+	{ 0, "no" },
+	{ 0, "off" },
+	{ 0, "false" },
+	{ 0, "0" },
+	{ 1, "yes" },
+	{ 1, "on" },
+	{ 1, "true" },
+	{ 1, "1" }
+};
+
+/* maps a baud rate to its termios constant, B0 when it has none */
+speed_t get_baud_speed(int baud)
+{
+	switch (baud)
+	{
+		case 1200: return B1200;
+		case 2400: return B2400;
+		case 4800: return B4800;
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+	}
+
+	return B0;
+}
+
+/*
+	Lists can be given several times. Each entry is appended, but the
+	first one from a later layer replaces what an earlier layer said.
+*/
+int config_append(char (*list)[64], int* count, int max, int* list_layer,
+	int layer, char* name, char* value)
+{
+	if (layer > *list_layer)
+	{
+		*count = 0;
+		*list_layer = layer;
+	}
+
+	if (*count >= max)
+	{
+		printf("too many %s entries!\n", name);
+		return -1;
+	}
+
+	if (strlen(value) >= sizeof(list[0]))
+	{
+		printf("%s is too long!\n", name);
+		return -1;
+	}
+
+	strcpy(list[(*count)++], value);
+
+	return 0;
+}
+
+/*
+	Sets one option. layer is 0 for the config file and 1 for the
+	command line: a camera or device list given on the command line
+	replaces the one from the file instead of adding to it.
+*/
+int config_set(config_t* config, char* name, char* value, int layer)
+{
+	config_option_t* option = NULL;
+	char* field;
+	char* end;
+	double number;
+	uint8 id;
+	int k;
+
+	for (k = 0; k < NELEMENTS(config_options); k++)
+	{
+		if (strcmp(config_options[k].name, name) == 0)
+			option = &config_options[k];
+	}
+
+	if (option == NULL)
+	{
+		printf("unknown option \"%s\"!\n", name);
+		return -1;
+	}
+
+	if ((value == NULL) && (option->type != CONFIG_FLAG))
+	{
+		printf("option \"%s\" needs a value!\n", name);
+		return -1;
+	}
+
+	field = (char*) config + option->offset;
+
+	switch (option->type)
+	{
+		case CONFIG_INT:
+		case CONFIG_DOUBLE:
+			/* strtod() also takes hex, for the PSM */
+			number = strtod(value, &end);
+
+			if ((end == value) || (*end != '\0') || (number < option->min) || (number > option->max) ||
+				((option->type == CONFIG_INT) && (number != (int) number)))
+			{
+				printf("%s must be a number from %g to %g!\n", name, option->min, option->max);
+				return -1;
+			}
+
+			if (option->type == CONFIG_INT)
+				*((int*) field) = (int) number;
+			else
+				*((double*) field) = number;
+			break;
+
+		case CONFIG_FLAG:
+			id = (value == NULL) ? 1 : get_id_from_name(value, flag_values, NELEMENTS(flag_values));
+
+			if (id == 0xFF)
+			{
+				printf("%s must be yes or no!\n", name);
+				return -1;
+			}
+
+			*((int*) field) = id;
+			break;
+
+		case CONFIG_BDADDR:
+			if (bachk(value) < 0)
+			{
+				printf("%s must look like 00:11:22:33:44:55!\n", name);
+				return -1;
+			}
+
+			/* fall through */
+
+		case CONFIG_STRING:
+			if (strlen(value) >= option->max)
+			{
+				printf("%s is too long!\n", name);
+				return -1;
+			}
+
+			strcpy(field, value);
+			break;
+
+		case CONFIG_COLOR:
+			id = get_color_id(value);
+
+			if (id == COLOR_UNKNOWN)
+			{
+				printf("unknown color!\n");
+				return -1;
+			}
+
+			*((int*) field) = id;
+			break;
+
+		case CONFIG_IO:
+			id = get_id_from_name(value, io_modes, NELEMENTS(io_modes));
+
+			if (id == 0xFF)
+			{
+				printf("io must be threads, epoll or io_uring!\n");
+				return -1;
+			}
+
+			*((int*) field) = id;
+			break;
+
+		case CONFIG_THRESHOLD:
+			id = get_id_from_name(value, threshold_modes, NELEMENTS(threshold_modes));
+
+			if (id == 0xFF)
+			{
+				printf("threshold must be fixed, otsu or percentile!\n");
+				return -1;
+			}
+
+			*((int*) field) = id;
+			break;
+
+		case CONFIG_CAMERA:
+			return config_append(config->camera, &config->ncameras, MAX_CAMERAS,
+				&config->camera_layer, layer, name, value);
+
+		case CONFIG_DEVICE:
+			return config_append(config->device, &config->ndevices, MAX_VEHICLES,
+				&config->device_layer, layer, name, value);
+	}
+
+	return 0;
+}
+
+/* strips the blanks around str, in place */
+char* config_trim(char* str)
+{
+	char* end;
+
+	while ((*str == ' ') || (*str == '\t'))
+		str++;
+
+	end = str + strlen(str);
+
+	while ((end > str) && strchr(" \t\r\n", end[-1]))
+		end--;
+
+	*end = '\0';
+
+	return str;
+}
+
+/* reads "<name> = <value>" lines, where '#' starts a comment */
+int config_load(config_t* config, char* path)
+{
+	FILE* file;
+	char line[256];
+	char* name;
+	char* value;
+	char* p;
+	int line_number = 0;
+	int status = 0;
+
+	file = fopen(path, "r");
+
+	if (file == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		line_number++;
+
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+
+		value = NULL;
+
+		if ((p = strchr(line, '=')) != NULL)
+		{
+			*p = '\0';
+			value = config_trim(p + 1);
+		}
+
+		name = config_trim(line);
+
+		if (*name == '\0')
+			continue;
+
+		if (config_set(config, name, value, 0) < 0)
+		{
+			printf("(%s, line %d)\n", path, line_number);
+			status = -1;
+		}
+	}
+
+	fclose(file);
+
+	return status;
+}
+
+/*
+	Reads a calibration file of "<name> = <value>" lines, the names
+	being height and pitch, which are required, and max-distance.
+*/
+int calibration_load(const char* path, calibration_t* cal)
+{
+	FILE* file;
+	char line[256];
+	char* name;
+	char* value;
+	char* end;
+	char* p;
+	double number;
+	int line_number = 0;
+	int status = 0;
+
+	memset(cal, 0, sizeof(calibration_t));
+	cal->height = -1;
+	cal->pitch = -90;
+	cal->max_distance = CALIBRATION_MAX_DISTANCE;
+
+	file = fopen(path, "r");
+
+	if (file == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		line_number++;
+
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+
+		value = "";
+
+		if ((p = strchr(line, '=')) != NULL)
+		{
+			*p = '\0';
+			value = config_trim(p + 1);
+		}
+
+		name = config_trim(line);
+
+		if (*name == '\0')
+			continue;
+
+		number = strtod(value, &end);
+
+		if ((end == value) || (*end != '\0'))
+		{
+			printf("%s must be a number! (%s, line %d)\n", name, path, line_number);
+			status = -1;
+		}
+		else if (strcmp(name, "height") == 0)
+		{
+			cal->height = number;
+		}
+		else if (strcmp(name, "pitch") == 0)
+		{
+			cal->pitch = number;
+		}
+		else if (strcmp(name, "max-distance") == 0)
+		{
+			cal->max_distance = number;
+		}
+		else
+		{
+			printf("unknown calibration \"%s\"! (%s, line %d)\n", name, path, line_number);
+			status = -1;
+		}
+	}
+
+	fclose(file);
+
+	if ((status == 0) && ((cal->height <= 0) || (cal->pitch <= -90) || (cal->pitch >= 90) || (cal->max_distance <= 0)))
+	{
+		printf("%s needs a height and a max-distance above 0 and a pitch between -90 and 90 degrees!\n", path);
+		status = -1;
+	}
+
+	cal->valid = (status == 0);
+
+	return status;
+}
+
+void print_config_options()
+{
+	int k;
+
+	printf("usage: ttycmd [--config=<file>] [--<option>[=<value>]...] [--bench-io] [--bench-vehicles] [--bench-vision] [--evaluate=<dataset>...] [<device>...]\n");
+	printf("options, also valid as \"<option> = <value>\" in the config file:\n");
+
+	for (k = 0; k < NELEMENTS(config_options); k++)
+		printf("\t%s\n", config_options[k].name);
+
+	printf("--event-loop and --io-uring are short for --io=epoll and --io=io_uring.\n");
+}
+
+#define REPL_LINE_MAX		128
+#define REPL_MAX_COMMANDS	16	/* per line */
+
+struct repl_command_s
+{
+	uint8 cmd;
+	uint8 val;
+};
+typedef struct repl_command_s repl_command_t;
+
+/* REPL input, read straight into line and parsed where it lies */
+struct repl_s
+{
+	char line[REPL_LINE_MAX];
+	int length;
+	int overflow;		/* dropping the rest of a line that did not fit */
+};
+typedef struct repl_s repl_t;
+
+/* a decimal in [min, max], unlike atoi() which wraps and ignores junk */
+int get_number_value(char* number_str, int min, int max, int* value)
+{
+	char* end;
+	long number;
+
+	if ((number_str == NULL) || (*number_str == '\0'))
+		return -1;
+
+	errno = 0;
+	number = strtol(number_str, &end, 10);
+
+	if ((errno != 0) || (*end != '\0') || (number < min) || (number > max))
+		return -1;
+
+	*value = (int) number;
+
+	return 0;
+}
+
+/*
+	Parses one "<command>[:<value>]" token, splitting it in place.
+	Returns -1, after saying why, when the command or its value is
+	not valid.
+*/
+int parse_command(char* token, repl_command_t* command)
+{
+	char* val_str;
+	int max = 255;
+	int number;
+
+	val_str = strchr(token, ':');
+
+	if (val_str != NULL)
+		*val_str++ = '\0';
+
+	command->cmd = get_command_id(token);
+	command->val = 0;
+
+	switch (command->cmd)
+	{
+		case CMD_UNKNOWN:
+			printf("unknown command!\n");
+			return -1;
+
+		case CMD_TEENSY_MODE:
+		case CMD_CHANGE_STATE:
+			command->val = get_state_id(val_str);
+
+			if (command->val == STATE_UNKNOWN)
+			{
+				printf((command->cmd == CMD_TEENSY_MODE) ? "unknown mode!\n" : "unknown state!\n");
+				return -1;
+			}
+			break;
+
+		case CMD_HARD_TURN:
+		case CMD_SOFT_TURN:
+			command->val = get_turn_id(val_str);
+
+			if (command->val == TURN_UNKNOWN)
+			{
+				printf("unknown turn!\n");
+				return -1;
+			}
+			break;
+
+		case CMD_SET_DIRECTION:
+			command->val = get_move_id(val_str);
+
+			if (command->val == MOVE_UNKNOWN)
+			{
+				printf("unknown move direction!\n");
+				return -1;
+			}
+			break;
+
+		case CMD_COLOR:
+			command->val = get_color_id(val_str);
+
+			if (command->val == COLOR_UNKNOWN)
+			{
+				printf("unknown color!\n");
+				return -1;
+			}
+			break;
+
+		case CMD_VICTORY:
+		case CMD_DIRECTION:
+			max = 100;
+
+			/* fall through, percentages */
+
+		case CMD_DIST_CENTER:
+		case CMD_DIST_LEFT:
+		case CMD_DIST_RIGHT:
+		case CMD_SPEED:
+		case CMD_QUALIFY:
+			if (get_number_value(val_str, 0, max, &number) < 0)
+			{
+				printf("%s takes a number from 0 to %d!\n", token, max);
+				return -1;
+			}
+
+			command->val = number;
+			break;
+
+		case CMD_VEHICLE:
+			if (get_number_value(val_str, 0, nvehicles - 1, &number) < 0)
+			{
+				printf("%s takes a car from 0 to %d!\n", token, nvehicles - 1);
+				return -1;
+			}
+
+			command->val = number;
+			break;
+
+		case CMD_HELP:
+			command->val = get_command_id(val_str);
+			break;
+	}
+
+	return 0;
+}
+
+void run_command(repl_command_t* command)
+{
+	calibration_t cal;
+	uint8 cmd = command->cmd;
+	uint8 val = command->val;
+
+	switch (cmd)
+	{
+		case CMD_TEENSY_MODE:
+		case CMD_CHANGE_STATE:
+		case CMD_HARD_TURN:
+		case CMD_SOFT_TURN:
+		case CMD_SET_DIRECTION:
+		case CMD_DIST_CENTER:
+		case CMD_DIST_LEFT:
+		case CMD_DIST_RIGHT:
+		case CMD_SPEED:
+			send_command(repl_vehicle, cmd, val);
+			break;
+
+		case CMD_VEHICLE:
+			repl_vehicle = &vehicles[val];
+			break;
+
+		case CMD_COLOR:
+			vision_params_set(offsetof(vision_params_t, color), val);
+			break;
+
+		case CMD_QUALIFY:
+			vision_params_set(offsetof(vision_params_t, qualify), val);
+			break;
+
+		case CMD_VICTORY:
+			vision_params_set(offsetof(vision_params_t, victory), val);
+			break;
+
+		case CMD_DIRECTION:
+			vision_params_set(offsetof(vision_params_t, direction), val);
+			break;
+
+		case CMD_CALIBRATE:
+			if (cfg->calibration[0] == '\0')
+				printf("no calibration file!\n");
+			else if (calibration_load(cfg->calibration, &cal) == 0)
+				calibration_set(&cal);
+			break;
+
+		case CMD_HELP:
+			switch (val)
+			{
+				case CMD_CHANGE_STATE:
+					printf("state:<state>, where <state> is one of the following:\n");
+					printf("nothing, basic, orders, dance.\n");
+					break;
+
+				case CMD_COLOR:
+					printf("color:<color>, where <color> is one of the following:\n");
+					printf("blue, green, red, white.\n");
+					break;
+
+				case CMD_VEHICLE:
+					printf("vehicle:<n> sends the commands that follow to car <n>,\n");
+					printf("counting from 0 in the order of the devices.\n");
+					break;
+
+				case CMD_CALIBRATE:
+					printf("calibrate rereads the calibration file, and the cameras\n");
+					printf("weigh the floor with it from their next frame.\n");
+					break;
+
+				default:
+					printf("command syntax: <command>:<value>[;<command>:<value>...]\n");
+					print_command_list();
+					break;
+			}
+
+			break;
+
+		case CMD_QUIT:
+			request_stop();
+			break;
+	}
+}
+
+/*
+	Runs one line of commands separated by ';' or blanks. The whole
+	line is parsed before anything runs, so a typo runs none of it,
+	and what it sends to each car leaves in a single write.
+*/
+void repl_run_line(char* line)
+{
+	repl_command_t commands[REPL_MAX_COMMANDS];
+	vehicle_t* vehicle;
+	int ncommands = 0;
+	char* token;
+	char* next;
+	int k;
+
+	for (token = line; *token != '\0'; token = next)
+	{
+		next = token + strcspn(token, "; \t\r");
+
+		if (*next != '\0')
+			*next++ = '\0';
+
+		if (*token == '\0')
+			continue;
+
+		if (ncommands == REPL_MAX_COMMANDS)
+		{
+			printf("more than %d commands on one line!\n", REPL_MAX_COMMANDS);
+			METRIC_ADD(metrics.repl_errors, 1);
+			return;
+		}
+
+		if (parse_command(token, &commands[ncommands++]) < 0)
+		{
+			METRIC_ADD(metrics.repl_errors, 1);
+			return;
+		}
+	}
+
+	vehicle = repl_vehicle;
+	tty_begin_batch(vehicle);
+
+	for (k = 0; k < ncommands; k++)
+	{
+		run_command(&commands[k]);
+
+		/* a vehicle command ends the batch of the previous car */
+		if (repl_vehicle != vehicle)
+		{
+			tty_end_batch(vehicle);
+			vehicle = repl_vehicle;
+			tty_begin_batch(vehicle);
+		}
+	}
+
+	tty_end_batch(vehicle);
+}
+
+/*
+	Takes n more bytes read into repl->line and runs every complete
+	line in it. A line that does not fit in the buffer is dropped,
+	up to and including its newline.
+*/
+void repl_feed(repl_t* repl, int n)
+{
+	char* start = repl->line;
+	char* end;
+
+	repl->length += n;
+	repl->line[repl->length] = '\0';
+
+	while ((end = memchr(start, '\n', repl->length - (start - repl->line))) != NULL)
+	{
+		*end = '\0';
+
+		if (repl->overflow)
+			repl->overflow = 0;
+		else
+			repl_run_line(start);
+
+		printf("cmd: ");
+		fflush(stdout);
+
+		start = end + 1;
+	}
+
+	repl->length -= start - repl->line;
+	memmove(repl->line, start, repl->length + 1);
+
+	if (repl->length == sizeof(repl->line) - 1)
+	{
+		if (!repl->overflow)
+		{
+			printf("line too long!\n");
+			METRIC_ADD(metrics.repl_errors, 1);
+		}
+
+		repl->overflow = 1;
+		repl->length = 0;
+	}
+}
+
+void* CmdThreadProc(void* data)
+{
+	repl_t repl = { { 0 } };
+	int n;
+
+	printf("cmd: ");
+	fflush(stdout);
+
+	while (!stop_wait(STDIN_FILENO, POLLIN, -1))
+	{
+		n = read(STDIN_FILENO, repl.line + repl.length, sizeof(repl.line) - 1 - repl.length);
+
+		/* stdin closed, keep driving without a REPL */
+		if (n <= 0)
+			break;
+
+		repl_feed(&repl, n);
+	}
+
+	return NULL;
+}
+
+/* the Teensy sends a command byte followed by its value */
+void comm_feed(vehicle_t* vehicle, uint8 comm)
+{
+	METRIC_ADD(metrics.serial_bytes_in, 1);
+
+	switch (vehicle->comm_pending)
+	{
+		case 0:
+			if ((comm == CMD_DIST_LEFT) || (comm == CMD_DIST_RIGHT) ||
+				(comm == CMD_DIST_CENTER) || (comm == CMD_TEENSY_MODE))
+			{
+				vehicle->comm_pending = comm;
+			}
+			else
+			{
+				METRIC_ADD(metrics.serial_errors, 1);
+			}
+			return;
+
+		case CMD_DIST_LEFT:
+			vehicle->sensor[SENSOR_LEFT] = comm;
+			__atomic_store_n(&vehicle->sensor_stamp[SENSOR_LEFT], monotonic_ms(), __ATOMIC_RELEASE);
+			break;
+
+		case CMD_DIST_RIGHT:
+			vehicle->sensor[SENSOR_RIGHT] = comm;
+			__atomic_store_n(&vehicle->sensor_stamp[SENSOR_RIGHT], monotonic_ms(), __ATOMIC_RELEASE);
+			break;
+
+		case CMD_DIST_CENTER:
+			vehicle->sensor[SENSOR_CENTER] = comm;
+			__atomic_store_n(&vehicle->sensor_stamp[SENSOR_CENTER], monotonic_ms(), __ATOMIC_RELEASE);
+			break;
+
+		case CMD_TEENSY_MODE:
+			vehicle->mode = comm;
+			break;
+	}
+
+	vehicle->comm_pending = 0;
+}
+
+void* CommThreadProc(void* data)
+{
+	vehicle_t* vehicle = (vehicle_t*) data;
+	uint8 buffer[64];
+	int n;
+	int i;
+
+	/* the tty is non-blocking, so wait for data instead of spinning */
+	while (!stop_wait(vehicle->tty_fd, POLLIN, -1))
+	{
+		n = read(vehicle->tty_fd, buffer, sizeof(buffer));
+
+		/* 0 is a hangup, which poll() would report over and over */
+		if ((n == 0) || ((n < 0) && (errno != EAGAIN) && (errno != EINTR)))
+		{
+			fprintf(stderr, "car %d tty: %s\n", vehicle->id, n ? strerror(errno) : "hung up");
+			request_stop();
+			break;
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			// printf("0x%02X\n", buffer[i]);
+			comm_feed(vehicle, buffer[i]);
+		}
+	}
+
+	pthread_exit(NULL);
+}
+
+void arm_timer(int fd, long ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+
+	/* a zero value would disarm the timer */
+	if (ms <= 0)
+		ms = 1;
+
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+
+	timerfd_settime(fd, 0, &its, NULL);
+}
+
+/* fires every ms milliseconds, starting ms from now */
+void arm_interval_timer(int fd, long ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	its.it_interval = its.it_value;
+
+	timerfd_settime(fd, 0, &its, NULL);
+}
+
+void epoll_add(int epfd, int fd, unsigned int events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* the vehicle whose tty or controller timer fd is, NULL for the shared fds */
+vehicle_t* find_vehicle(int fd)
+{
+	int k;
+
+	for (k = 0; k < nvehicles; k++)
+	{
+		if ((vehicles[k].tty_fd == fd) || (vehicles[k].intel_timer == fd))
+			return &vehicles[k];
+	}
+
+	return NULL;
+}
+
+/* for the reactors: whether the vehicle has a decision its controller has not seen */
+int decision_pending(vehicle_t* vehicle)
+{
+	int pending;
+
+	pthread_mutex_lock(&decision_mutex);
+	pending = (vehicle->decision_seen != vehicle->decision_seq);
+	vehicle->decision_seen = vehicle->decision_seq;
+	pthread_mutex_unlock(&decision_mutex);
+
+	return pending;
+}
+
+/*
+	Alternative to the cmd, comm, intel and bt threads: a single epoll
+	reactor owns the ttys of all cars, stdin, the telemetry socket and
+	the timers, so all control state is touched from one thread in a
+	fixed order. Only the camera pipelines keep their own threads, and
+	they wake the reactor through an eventfd when they publish a new
+	decision.
+*/
+int run_event_loop()
+{
+	struct epoll_event events[32];
+	struct sockaddr_l2 addr;
+	uint8 buffer[64];
+	repl_t repl = { { 0 } };
+	char sendbuffer[256];
+	vehicle_t* vehicle;
+	int epfd;
+	int telemetry_timer;
+	int watchdog_timer;
+	int bt_socket = -1;
+	int error;
+	socklen_t error_len;
+	eventfd_t ticks;
+	struct signalfd_siginfo siginfo;
+	int nevents;
+	int fd;
+	int n;
+	int i;
+	int k;
+
+	epfd = epoll_create1(0);
+	decision_event_fd = eventfd(0, EFD_NONBLOCK);
+	telemetry_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	watchdog_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+
+	for (k = 0; k < nvehicles; k++)
+	{
+		vehicles[k].intel_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+
+		if (vehicles[k].intel_timer < 0)
+			epfd = -1;
+	}
+
+	if ((epfd < 0) || (decision_event_fd < 0) ||
+		(telemetry_timer < 0) || (watchdog_timer < 0))
+	{
+		perror("event loop");
+		return -1;
+	}
+
+	arm_interval_timer(telemetry_timer, cfg->telemetry_interval);
+	arm_interval_timer(watchdog_timer, WATCHDOG_PERIOD);
+
+	telemetry_address(&addr);
+
+	for (k = 0; k < nvehicles; k++)
+	{
+		epoll_add(epfd, vehicles[k].tty_fd, EPOLLIN);
+		epoll_add(epfd, vehicles[k].intel_timer, EPOLLIN);
+	}
+
+	epoll_add(epfd, STDIN_FILENO, EPOLLIN);
+	epoll_add(epfd, decision_event_fd, EPOLLIN);
+	epoll_add(epfd, telemetry_timer, EPOLLIN);
+	epoll_add(epfd, watchdog_timer, EPOLLIN);
+	epoll_add(epfd, stop_fd, EPOLLIN);
+	epoll_add(epfd, signal_fd, EPOLLIN);
+
+	for (k = 0; k < nvehicles; k++)
+		arm_timer(vehicles[k].intel_timer, intel_run(&vehicles[k]));
+
+	if (!quiet)
+	{
+		printf("cmd: ");
+		fflush(stdout);
+	}
+
+	while (!stop_requested)
+	{
+		nevents = epoll_wait(epfd, events, NELEMENTS(events), -1);
+		io_syscalls++;
+
+		for (i = 0; i < nevents; i++)
+		{
+			fd = events[i].data.fd;
+
+			if (fd == stop_fd)
+			{
+				break;
+			}
+			else if (fd == signal_fd)
+			{
+				read(signal_fd, &siginfo, sizeof(siginfo));
+				request_stop();
+				break;
+			}
+			else if ((vehicle = find_vehicle(fd)) != NULL)
+			{
+				if (fd == vehicle->tty_fd)
+				{
+					n = read(fd, buffer, sizeof(buffer));
+					io_syscalls++;
+
+					/* a hung up tty stays readable, level-triggered epoll would spin on it */
+					if ((n == 0) || ((n < 0) && (errno != EAGAIN) && (errno != EINTR)))
+					{
+						fprintf(stderr, "car %d tty: %s\n", vehicle->id, n ? strerror(errno) : "hung up");
+						epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+						request_stop();
+						break;
+					}
+
+					for (k = 0; k < n; k++)
+						comm_feed(vehicle, buffer[k]);
+				}
+				else
+				{
+					read(fd, &ticks, sizeof(ticks));
+					arm_timer(fd, intel_run(vehicle));
+				}
+			}
+			else if (fd == STDIN_FILENO)
+			{
+				n = read(STDIN_FILENO, repl.line + repl.length, sizeof(repl.line) - 1 - repl.length);
+
+				if (n <= 0)
+				{
+					/* stdin closed, keep driving without a REPL */
+					epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+					continue;
+				}
+
+				repl_feed(&repl, n);
+			}
+			else if (fd == decision_event_fd)
+			{
+				eventfd_read(decision_event_fd, &ticks);
+
+				/* only the cars whose cameras changed their minds */
+				for (k = 0; k < nvehicles; k++)
+				{
+					if (decision_pending(&vehicles[k]))
+						arm_timer(vehicles[k].intel_timer, intel_run(&vehicles[k]));
+				}
+			}
+			else if (fd == watchdog_timer)
+			{
+				read(watchdog_timer, &ticks, sizeof(ticks));
+
+				for (k = 0; k < nvehicles; k++)
+				{
+					if (watchdog_check(&vehicles[k]))
+						arm_timer(vehicles[k].intel_timer, intel_run(&vehicles[k]));
+				}
+			}
+			else if (fd == telemetry_timer)
+			{
+				read(telemetry_timer, &ticks, sizeof(ticks));
+
+				/* the previous report is still connecting */
+				if (bt_socket >= 0)
+					continue;
+
+				bt_socket = socket(AF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK, BTPROTO_L2CAP);
+
+				if (bt_socket < 0)
+				{
+					METRIC_ADD(metrics.telemetry_failed, 1);
+					continue;
+				}
+
+				if ((connect(bt_socket, (struct sockaddr*) &addr, sizeof(addr)) < 0) &&
+					(errno != EINPROGRESS))
+				{
+					METRIC_ADD(metrics.telemetry_failed, 1);
+					close(bt_socket);
+					bt_socket = -1;
+					continue;
+				}
+
+				epoll_add(epfd, bt_socket, EPOLLOUT);
+			}
+			else if (fd == bt_socket)
+			{
+				error = 0;
+				error_len = sizeof(error);
+				getsockopt(bt_socket, SOL_SOCKET, SO_ERROR, &error, &error_len);
+
+				/* one report per car over the same connection */
+				for (k = 0; (error == 0) && (k < nvehicles); k++)
+				{
+					if (write(bt_socket, sendbuffer,
+						format_telemetry(&vehicles[k], sendbuffer, sizeof(sendbuffer))) < 0)
+					{
+						perror("DERP!");
+						error = errno;
+					}
+				}
+
+				if (error != 0)
+					METRIC_ADD(metrics.telemetry_failed, 1);
+				else
+					METRIC_ADD(metrics.telemetry_sent, 1);
+
+				epoll_ctl(epfd, EPOLL_CTL_DEL, bt_socket, NULL);
+				close(bt_socket);
+				bt_socket = -1;
+			}
+		}
+	}
+
+	if (bt_socket >= 0)
+		close(bt_socket);
+
+	for (k = 0; k < nvehicles; k++)
+	{
+		close(vehicles[k].intel_timer);
+		vehicles[k].intel_timer = -1;
+	}
+
+	close(telemetry_timer);
+	close(watchdog_timer);
+	close(epfd);
+
+	return 0;
+}
+
+/*
+	Minimal io_uring ring over the raw syscalls, enough for the reactor
+	below: one submission and one completion queue mapped from the
+	kernel, plus a local tail for entries not yet handed over.
+*/
+struct uring_s
+{
+	int fd;
+	unsigned int entries;
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	struct io_uring_sqe* sqes;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	struct io_uring_cqe* cqes;
+	unsigned int local_tail;
+	unsigned int submitted_tail;
+};
+typedef struct uring_s uring_t;
+
+#define URING_ENTRIES		128	/* room for every car's reads and writes */
+
+#define URING_TTY_READ		1
+#define URING_TTY_WRITE		2
+#define URING_STDIN_READ	3
+#define URING_DECISION		4
+#define URING_INTEL_TIMER	5
+#define URING_TELEMETRY_TIMER	6
+#define URING_BT_CONNECT	7
+#define URING_BT_SEND		8
+#define URING_STOP		9
+#define URING_SIGNAL		10
+#define URING_WATCHDOG_TIMER	11
+
+/* the operations of a car carry its index above the kind */
+#define URING_KIND(data)	((data) & 0xFF)
+#define URING_VEHICLE(data)	((data) >> 8)
+#define URING_DATA(kind, vehicle)	((kind) | ((unsigned long long) (vehicle)->id << 8))
+
+/* the opcodes run_uring_loop() submits, 5.1 to 5.5 kernels lack some of them */
+static const int uring_opcodes[] = {
+	IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_WRITE,
+	IORING_OP_SEND, IORING_OP_CONNECT, IORING_OP_POLL_ADD
+};
+
+/* returns 0 when the kernel handles every opcode we submit, -1 otherwise */
+int uring_probe(int fd)
+{
+	union
+	{
+		struct io_uring_probe probe;
+		char space[sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)];
+	} u;
+	unsigned int k;
+	int op;
+
+	memset(&u, 0, sizeof(u));
+
+	/* kernels before 5.6 don't know the probe either */
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, &u.probe, 256) < 0)
+		return -1;
+
+	for (k = 0; k < NELEMENTS(uring_opcodes); k++)
+	{
+		op = uring_opcodes[k];
+
+		if ((op >= u.probe.ops_len) || !(u.probe.ops[op].flags & IO_URING_OP_SUPPORTED))
+			return -1;
+	}
+
+	return 0;
+}
+
+int uring_init(uring_t* ring, unsigned int entries)
+{
+	struct io_uring_params params;
+	char* sq;
+	char* cq;
+
+	memset(ring, 0, sizeof(uring_t));
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+
+	if (ring->fd < 0)
+		return -1;
+
+	if (uring_probe(ring->fd) < 0)
+	{
+		close(ring->fd);
+		return -1;
+	}
+
+	ring->entries = params.sq_entries;
+
+	sq = mmap(NULL, params.sq_off.array + params.sq_entries * sizeof(unsigned int),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	cq = mmap(NULL, params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+	if ((sq == MAP_FAILED) || (cq == MAP_FAILED) || (ring->sqes == MAP_FAILED))
+	{
+		close(ring->fd);
+		return -1;
+	}
+
+	ring->sq_head = (unsigned int*) (sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int*) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int*) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int*) (sq + params.sq_off.array);
+	ring->cq_head = (unsigned int*) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int*) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int*) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+	ring->local_tail = *ring->sq_tail;
+	ring->submitted_tail = ring->local_tail;
+
+	return 0;
+}
+
+/* queues an operation, it is handed to the kernel by the next uring_submit() */
+struct io_uring_sqe* uring_prep(uring_t* ring, int opcode, int fd,
+	void* addr, unsigned int len, unsigned long long user_data)
+{
+	struct io_uring_sqe* sqe;
+	unsigned int index;
+
+	if (ring->local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries)
+		return NULL;
+
+	index = ring->local_tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) addr;
+	sqe->len = len;
+	sqe->user_data = user_data;
+
+	/* the tty, stdin and eventfds don't seek, use the current position */
+	if ((opcode == IORING_OP_READ) || (opcode == IORING_OP_READ_FIXED) || (opcode == IORING_OP_WRITE))
+		sqe->off = (unsigned long long) -1;
+
+	ring->sq_array[index] = index;
+	ring->local_tail++;
+
+	return sqe;
+}
+
+/* submits everything queued and waits for at least wait_nr completions */
+int uring_submit(uring_t* ring, unsigned int wait_nr)
+{
+	unsigned int to_submit;
+	int status;
+
+	to_submit = ring->local_tail - ring->submitted_tail;
+	__atomic_store_n(ring->sq_tail, ring->local_tail, __ATOMIC_RELEASE);
+	ring->submitted_tail = ring->local_tail;
+
+	do
+	{
+		io_syscalls++;
+		status = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+			wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		to_submit = 0;
+	}
+	while ((status < 0) && (errno == EINTR));
+
+	return status;
+}
+
+struct io_uring_cqe* uring_peek(uring_t* ring)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_seen(uring_t* ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register_buffers(uring_t* ring, struct iovec* iov, int count)
+{
+	return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, count);
+}
+
+void set_blocking(int fd)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+}
+
+/* hands the vehicle's pending serial queue to the ring, one write in flight at a time */
+void uring_flush_tty(uring_t* ring, vehicle_t* vehicle)
+{
+	pthread_mutex_lock(&vehicle->tty_mutex);
+
+	if ((vehicle->tty_out_len > 0) && !vehicle->writing)
+	{
+		memcpy(vehicle->inflight, vehicle->tty_out, vehicle->tty_out_len);
+
+		if (uring_prep(ring, IORING_OP_WRITE, vehicle->tty_fd, vehicle->inflight,
+			vehicle->tty_out_len, URING_DATA(URING_TTY_WRITE, vehicle)))
+		{
+			vehicle->writing = 1;
+			vehicle->inflight_len = vehicle->tty_out_len;
+			vehicle->tty_out_len = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&vehicle->tty_mutex);
+}
+
+/* queues the read of the vehicle's tty into its registered buffer */
+void uring_read_tty(uring_t* ring, vehicle_t* vehicle)
+{
+	struct io_uring_sqe* sqe;
+
+	sqe = uring_prep(ring, IORING_OP_READ_FIXED, vehicle->tty_fd, vehicle->tty_in,
+		sizeof(vehicle->tty_in), URING_DATA(URING_TTY_READ, vehicle));
+	sqe->buf_index = vehicle->id;
+}
+
+/*
+	io_uring flavour of run_event_loop(). Every fd has a read in flight,
+	each tty reads into its own registered buffer, and serial writes
+	and telemetry sends go through the ring too, so one io_uring_enter()
+	per iteration submits all new work and collects all completions.
+	Returns -1 without side effects when the kernel lacks io_uring.
+*/
+int run_uring_loop()
+{
+	struct iovec iov[MAX_VEHICLES];
+	uring_t ring;
+	struct io_uring_cqe* cqe;
+	struct io_uring_sqe* sqe;
+	struct sockaddr_l2 addr;
+	repl_t repl = { { 0 } };
+	char sendbuffers[MAX_VEHICLES][256];
+	vehicle_t* vehicle;
+	int writing;
+	int telemetry_timer;
+	int watchdog_timer;
+	int bt_socket = -1;
+	int bt_sending = 0;
+	int bt_failed = 0;
+	uint64_t decision_ticks;
+	uint64_t intel_ticks[MAX_VEHICLES];
+	uint64_t telemetry_ticks;
+	uint64_t watchdog_ticks;
+	struct signalfd_siginfo siginfo;
+	int res;
+	int k;
+
+	if (uring_init(&ring, URING_ENTRIES) < 0)
+		return -1;
+
+	for (k = 0; k < nvehicles; k++)
+	{
+		iov[k].iov_base = vehicles[k].tty_in;
+		iov[k].iov_len = sizeof(vehicles[k].tty_in);
+	}
+
+	if (uring_register_buffers(&ring, iov, nvehicles) < 0)
+	{
+		close(ring.fd);
+		return -1;
+	}
+
+	/* the ring waits for us, so the fds go back to blocking mode */
+	for (k = 0; k < nvehicles; k++)
+	{
+		set_blocking(vehicles[k].tty_fd);
+		vehicles[k].intel_timer = timerfd_create(CLOCK_MONOTONIC, 0);
+	}
+
+	decision_event_fd = eventfd(0, 0);
+	telemetry_timer = timerfd_create(CLOCK_MONOTONIC, 0);
+	watchdog_timer = timerfd_create(CLOCK_MONOTONIC, 0);
+
+	arm_interval_timer(telemetry_timer, cfg->telemetry_interval);
+	arm_interval_timer(watchdog_timer, WATCHDOG_PERIOD);
+
+	telemetry_address(&addr);
+
+	tty_deferred = 1;
+
+	for (k = 0; k < nvehicles; k++)
+	{
+		vehicle = &vehicles[k];
+		uring_read_tty(&ring, vehicle);
+		uring_prep(&ring, IORING_OP_READ, vehicle->intel_timer, &intel_ticks[k], 8,
+			URING_DATA(URING_INTEL_TIMER, vehicle));
+	}
+
+	uring_prep(&ring, IORING_OP_READ, STDIN_FILENO, repl.line, sizeof(repl.line) - 1, URING_STDIN_READ);
+	uring_prep(&ring, IORING_OP_READ, decision_event_fd, &decision_ticks, 8, URING_DECISION);
+	uring_prep(&ring, IORING_OP_READ, telemetry_timer, &telemetry_ticks, 8, URING_TELEMETRY_TIMER);
+	uring_prep(&ring, IORING_OP_READ, watchdog_timer, &watchdog_ticks, 8, URING_WATCHDOG_TIMER);
+
+	/*
+		Poll rather than read: the stop token must stay readable for the
+		camera threads, and a signalfd read from an io_uring worker would
+		look at the worker's signals instead of ours.
+	*/
+	sqe = uring_prep(&ring, IORING_OP_POLL_ADD, stop_fd, NULL, 0, URING_STOP);
+	sqe->poll32_events = POLLIN;
+	sqe = uring_prep(&ring, IORING_OP_POLL_ADD, signal_fd, NULL, 0, URING_SIGNAL);
+	sqe->poll32_events = POLLIN;
+
+	for (k = 0; k < nvehicles; k++)
+		arm_timer(vehicles[k].intel_timer, intel_run(&vehicles[k]));
+
+	if (!quiet)
+	{
+		printf("cmd: ");
+		fflush(stdout);
+	}
+
+	while (!stop_requested)
+	{
+		for (k = 0; k < nvehicles; k++)
+			uring_flush_tty(&ring, &vehicles[k]);
+
+		uring_submit(&ring, 1);
+
+		while ((cqe = uring_peek(&ring)) != NULL)
+		{
+			res = cqe->res;
+			vehicle = &vehicles[URING_VEHICLE(cqe->user_data)];
+
+			switch (URING_KIND(cqe->user_data))
+			{
+				case URING_TTY_READ:
+					/* a dead or hung up tty would complete again at once, forever */
+					if (res <= 0)
+					{
+						fprintf(stderr, "car %d tty: %s\n", vehicle->id, res ? strerror(-res) : "hung up");
+						request_stop();
+						break;
+					}
+
+					for (k = 0; k < res; k++)
+						comm_feed(vehicle, vehicle->tty_in[k]);
+
+					uring_read_tty(&ring, vehicle);
+					break;
+
+				case URING_TTY_WRITE:
+					if (res > 0)
+					{
+						METRIC_ADD(metrics.serial_writes, 1);
+						METRIC_ADD(metrics.serial_bytes_out, res);
+					}
+
+					/* a short write keeps the rest in flight */
+					if ((res > 0) && (res < vehicle->inflight_len))
+					{
+						vehicle->inflight_len -= res;
+						memmove(vehicle->inflight, vehicle->inflight + res, vehicle->inflight_len);
+
+						if (uring_prep(&ring, IORING_OP_WRITE, vehicle->tty_fd, vehicle->inflight,
+							vehicle->inflight_len, URING_DATA(URING_TTY_WRITE, vehicle)))
+							break;
+
+						res = 0;
+					}
+
+					if (res <= 0)
+					{
+						fprintf(stderr, "write: %s\n", res ? strerror(-res) : "short write");
+
+						pthread_mutex_lock(&vehicle->tty_mutex);
+						tty_forget(vehicle, vehicle->inflight, 0, vehicle->inflight_len);
+						pthread_mutex_unlock(&vehicle->tty_mutex);
+					}
+
+					vehicle->writing = 0;
+					break;
+
+				case URING_STDIN_READ:
+					/* stdin closed, keep driving without a REPL */
+					if (res <= 0)
+						break;
+
+					repl_feed(&repl, res);
+					uring_prep(&ring, IORING_OP_READ, STDIN_FILENO, repl.line + repl.length,
+						sizeof(repl.line) - 1 - repl.length, URING_STDIN_READ);
+					break;
+
+				case URING_DECISION:
+					if (res < 0)
+					{
+						fprintf(stderr, "decision: %s\n", strerror(-res));
+						request_stop();
+						break;
+					}
+
+					uring_prep(&ring, IORING_OP_READ, decision_event_fd, &decision_ticks, 8, URING_DECISION);
+
+					/* only the cars whose cameras changed their minds */
+					for (k = 0; k < nvehicles; k++)
+					{
+						if (decision_pending(&vehicles[k]))
+							arm_timer(vehicles[k].intel_timer, intel_run(&vehicles[k]));
+					}
+					break;
+
+				case URING_INTEL_TIMER:
+					if (res < 0)
+					{
+						fprintf(stderr, "intel timer: %s\n", strerror(-res));
+						request_stop();
+						break;
+					}
+
+					arm_timer(vehicle->intel_timer, intel_run(vehicle));
+					uring_prep(&ring, IORING_OP_READ, vehicle->intel_timer, &intel_ticks[vehicle->id], 8,
+						URING_DATA(URING_INTEL_TIMER, vehicle));
+					break;
+
+				case URING_WATCHDOG_TIMER:
+					if (res < 0)
+					{
+						fprintf(stderr, "watchdog timer: %s\n", strerror(-res));
+						request_stop();
+						break;
+					}
+
+					uring_prep(&ring, IORING_OP_READ, watchdog_timer, &watchdog_ticks, 8, URING_WATCHDOG_TIMER);
+
+					for (k = 0; k < nvehicles; k++)
+					{
+						if (watchdog_check(&vehicles[k]))
+							arm_timer(vehicles[k].intel_timer, intel_run(&vehicles[k]));
+					}
+					break;
+
+				case URING_TELEMETRY_TIMER:
+					/* the cars can drive on without telemetry */
+					if (res < 0)
+					{
+						fprintf(stderr, "telemetry timer: %s\n", strerror(-res));
+						break;
+					}
+
+					uring_prep(&ring, IORING_OP_READ, telemetry_timer, &telemetry_ticks, 8, URING_TELEMETRY_TIMER);
+
+					/* the previous report is still in flight */
+					if (bt_socket >= 0)
+						break;
+
+					bt_socket = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+
+					if (bt_socket < 0)
+					{
+						METRIC_ADD(metrics.telemetry_failed, 1);
+						break;
+					}
+
+					sqe = uring_prep(&ring, IORING_OP_CONNECT, bt_socket, &addr, 0, URING_BT_CONNECT);
+					sqe->off = sizeof(addr);
+					break;
+
+				case URING_BT_CONNECT:
+					if (res == 0)
+					{
+						/* one report per car, linked so they leave in order */
+						for (k = 0; k < nvehicles; k++)
+						{
+							sqe = uring_prep(&ring, IORING_OP_SEND, bt_socket, sendbuffers[k],
+								format_telemetry(&vehicles[k], sendbuffers[k], sizeof(sendbuffers[k])),
+								URING_BT_SEND);
+
+							if (k < nvehicles - 1)
+								sqe->flags |= IOSQE_IO_LINK;
+						}
+
+						bt_sending = nvehicles;
+						bt_failed = 0;
+						break;
+					}
+
+					METRIC_ADD(metrics.telemetry_failed, 1);
+					close(bt_socket);
+					bt_socket = -1;
+					break;
+
+				case URING_BT_SEND:
+					/* a failed send cancels the rest of the chain */
+					if (res < 0)
+					{
+						if (res != -ECANCELED)
+							fprintf(stderr, "DERP!: %s\n", strerror(-res));
+
+						bt_failed = 1;
+					}
+
+					if (--bt_sending > 0)
+						break;
+
+					if (bt_failed)
+						METRIC_ADD(metrics.telemetry_failed, 1);
+					else
+						METRIC_ADD(metrics.telemetry_sent, 1);
+
+					close(bt_socket);
+					bt_socket = -1;
+					break;
+
+				case URING_SIGNAL:
+					read(signal_fd, &siginfo, sizeof(siginfo));
+					request_stop();
+					break;
+
+				case URING_STOP:
+					break;
+			}
+
+			uring_seen(&ring);
+		}
+	}
+
+	/* let the last serial writes land before the ring goes away */
+	for (;;)
+	{
+		writing = 0;
+
+		for (k = 0; k < nvehicles; k++)
+			writing += vehicles[k].writing;
+
+		if (writing == 0)
+			break;
+
+		uring_submit(&ring, 1);
+
+		while ((cqe = uring_peek(&ring)) != NULL)
+		{
+			if (URING_KIND(cqe->user_data) == URING_TTY_WRITE)
+				vehicles[URING_VEHICLE(cqe->user_data)].writing = 0;
+
+			uring_seen(&ring);
+		}
+	}
+
+	tty_deferred = 0;
+
+	if (bt_socket >= 0)
+		close(bt_socket);
+
+	close(ring.fd);
+
+	for (k = 0; k < nvehicles; k++)
+	{
+		close(vehicles[k].intel_timer);
+		vehicles[k].intel_timer = -1;
+	}
+
+	close(telemetry_timer);
+	close(watchdog_timer);
+
+	return 0;
+}
+
+/* plays the Teensy on the far side of the pty: answers each command with a sensor report */
+void* TeensyStandInThreadProc(void* data)
+{
+	int fd = *((int*) data);
+	uint8 buffer[64];
+	uint8 reply[2];
+	int pending = 0;
+	int n;
+	int i;
+
+	while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+	{
+		for (i = 0; i < n; i++)
+		{
+			if (++pending < 2)
+				continue;
+
+			pending = 0;
+			reply[0] = CMD_DIST_CENTER;
+			reply[1] = 100;
+			write(fd, reply, sizeof(reply));
+		}
+	}
+
+	return NULL;
+}
+
+#define BENCH_IO_ROUNDS		2000
+
+/* sends the controller's steady-state batch and waits for the three replies */
+void bench_io_batch(vehicle_t* vehicle)
+{
+	tty_begin_batch(vehicle);
+	send_command(vehicle, CMD_HARD_TURN, TURN_NONE);
+	send_command(vehicle, CMD_SPEED, 127);
+	send_command(vehicle, CMD_SET_DIRECTION, MOVE_FORWARD);
+	tty_end_batch(vehicle);
+}
+
+void bench_io_report(char* name, long* latency, unsigned long syscalls)
+{
+	long min = latency[0];
+	long max = latency[0];
+	long long total = 0;
+	int i;
+
+	for (i = 0; i < BENCH_IO_ROUNDS; i++)
+	{
+		if (latency[i] < min)
+			min = latency[i];
+
+		if (latency[i] > max)
+			max = latency[i];
+
+		total += latency[i];
+	}
+
+	printf("%s: %.2f syscalls per batch, round trip min %ld us, avg %lld us, max %ld us\n",
+		name, (double) syscalls / BENCH_IO_ROUNDS, min, total / BENCH_IO_ROUNDS, max);
+}
+
+long bench_elapsed_us(struct timespec* start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000L;
+}
+
+/* opens a raw pty pair, returns the side the vehicle uses and the Teensy's side in master */
+int bench_open_pty(int* master)
+{
+	struct termios tio;
+	int fd;
+
+	*master = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if ((*master < 0) || (grantpt(*master) < 0) || (unlockpt(*master) < 0))
+	{
+		perror("pty");
+		return -1;
+	}
+
+	fd = open(ptsname(*master), O_RDWR | O_NOCTTY | O_NONBLOCK);
+	tcgetattr(fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(fd, TCSANOW, &tio);
+	tcgetattr(*master, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(*master, TCSANOW, &tio);
+
+	return fd;
+}
+
+/*
+	Drives the same three-command batch through the epoll and io_uring
+	paths against a pty whose master side plays the Teensy, and reports
+	syscalls per batch and the command to sensor reply latency.
+*/
+int run_io_bench()
+{
+	static long latency[BENCH_IO_ROUNDS];
+	struct epoll_event event;
+	struct timespec start;
+	struct io_uring_cqe* cqe;
+	struct iovec iov;
+	uring_t ring;
+	vehicle_t* vehicle;
+	pthread_t teensy;
+	int master;
+	int epfd;
+	int received;
+	int round;
+	int n;
+
+	vehicle = add_vehicle(bench_open_pty(&master));
+
+	if (vehicle->tty_fd < 0)
+		return -1;
+
+	pthread_create(&teensy, NULL, TeensyStandInThreadProc, &master);
+
+	quiet = 1;
+
+	/* epoll: one write per batch, then epoll_wait and read until all replies are in */
+	epfd = epoll_create1(0);
+	epoll_add(epfd, vehicle->tty_fd, EPOLLIN);
+	io_syscalls = 0;
+
+	for (round = 0; round < BENCH_IO_ROUNDS; round++)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		bench_io_batch(vehicle);
+
+		for (received = 0; received < 6; )
+		{
+			io_syscalls++;
+			epoll_wait(epfd, &event, 1, -1);
+			io_syscalls++;
+			n = read(vehicle->tty_fd, vehicle->tty_in, sizeof(vehicle->tty_in));
+
+			if (n > 0)
+				received += n;
+		}
+
+		latency[round] = bench_elapsed_us(&start);
+	}
+
+	bench_io_report("epoll", latency, io_syscalls);
+	close(epfd);
+
+	/* io_uring: the write and the fixed-buffer read share one io_uring_enter */
+	iov.iov_base = vehicle->tty_in;
+	iov.iov_len = sizeof(vehicle->tty_in);
+
+	if (uring_init(&ring, URING_ENTRIES) < 0 ||
+		uring_register_buffers(&ring, &iov, 1) < 0)
+	{
+		printf("io_uring: not supported by this kernel\n");
+		return 0;
+	}
+
+	set_blocking(vehicle->tty_fd);
+	tty_deferred = 1;
+	io_syscalls = 0;
+
+	for (round = 0; round < BENCH_IO_ROUNDS; round++)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		bench_io_batch(vehicle);
+		uring_flush_tty(&ring, vehicle);
+
+		for (received = 0; received < 6; )
+		{
+			uring_read_tty(&ring, vehicle);
+
+			/* keep waiting until the read completed, the write may come first */
+			for (n = 0; n == 0; )
+			{
+				uring_submit(&ring, 1);
+
+				while ((cqe = uring_peek(&ring)) != NULL)
+				{
+					if (URING_KIND(cqe->user_data) == URING_TTY_WRITE)
+					{
+						vehicle->writing = 0;
+					}
+					else if (cqe->res > 0)
+					{
+						received += cqe->res;
+						n = 1;
+					}
+					else
+					{
+						n = -1;
+					}
+
+					uring_seen(&ring);
+				}
+			}
+
+			if (n < 0)
+				break;
+		}
+
+		latency[round] = bench_elapsed_us(&start);
+	}
+
+	bench_io_report("io_uring", latency, io_syscalls);
+
+	tty_deferred = 0;
+	quiet = 0;
+
+	return 0;
+}
+
+#define BENCH_STREAM_TIME	1000	/* ms of sensor reports before a link goes silent */
+#define BENCH_STREAM_PERIOD	10	/* ms between reports, the Teensy's 100 Hz */
+
+/* the far side of one simulated car */
+struct bench_vehicle_s
+{
+	int master;
+	long silent;		/* monotonic ms when the reports stopped */
+	long stopped;		/* when speed 0 arrived after that, -1 if it never did */
+	pthread_t thread;
+};
+typedef struct bench_vehicle_s bench_vehicle_t;
+
+/* plays a Teensy that streams distance reports, then goes silent and waits to be stopped */
+void* SensorStreamThreadProc(void* data)
+{
+	bench_vehicle_t* bench = (bench_vehicle_t*) data;
+	uint8 report[] = { CMD_DIST_LEFT, 100, CMD_DIST_RIGHT, 100, CMD_DIST_CENTER, 100 };
+	uint8 buffer[64];
+	struct pollfd pfd;
+	long next = monotonic_ms();
+	long end = next + BENCH_STREAM_TIME;
+	long last = next;
+	long now;
+	int pending = 0;
+	uint8 cmd = 0;
+	int n;
+	int i;
+
+	bench->silent = 0;
+	bench->stopped = -1;
+	pfd.fd = bench->master;
+	pfd.events = POLLIN;
+
+	for (;;)
+	{
+		now = monotonic_ms();
+
+		if (now < end)
+		{
+			if (now >= next)
+			{
+				write(bench->master, report, sizeof(report));
+				last = now;
+				next += BENCH_STREAM_PERIOD;
+			}
+		}
+		else if (bench->silent == 0)
+		{
+			bench->silent = last;
+		}
+		else if (now - bench->silent > cfg->sensor_deadline + 1000)
+		{
+			return NULL;
+		}
+
+		if (poll(&pfd, 1, (now < end) ? next - now : 10) <= 0)
+			continue;
+
+		n = read(bench->master, buffer, sizeof(buffer));
+
+		/* the controller sends command and value pairs */
+		for (i = 0; i < n; i++)
+		{
+			if (pending++ == 0)
+			{
+				cmd = buffer[i];
+				continue;
+			}
+
+			pending = 0;
+
+			if (bench->silent && (cmd == CMD_SPEED) && (buffer[i] == 0))
+			{
+				bench->stopped = monotonic_ms();
+				return NULL;
+			}
+		}
+	}
+}
+
+void* BenchReactorThreadProc(void* data)
+{
+	run_event_loop();
+
+	return NULL;
+}
+
+/* CPU time a live thread has used, in ms */
+double bench_thread_cpu_ms(pthread_t thread)
+{
+	struct timespec ts;
+	clockid_t clock;
+
+	if ((pthread_getcpuclockid(thread, &clock) != 0) || (clock_gettime(clock, &ts) != 0))
+		return 0;
+
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/*
+	Drives 1 to MAX_VEHICLES simulated cars over ptys, first with a
+	comm and an intel thread per car, then with the shared epoll
+	reactor. Every car streams distance reports for a second and then
+	goes silent; the report is how late past sensor-deadline the stop
+	command arrived, on average and for the worst car, and how much CPU
+	the control threads used per car meanwhile.
+*/
+int run_vehicle_bench()
+{
+	static bench_vehicle_t bench[MAX_VEHICLES];
+	pthread_t reactor;
+	eventfd_t ticks;
+	double cpu;
+	long late;
+	long total;
+	long max;
+	int missed;
+	int mode;
+	int count;
+	int k;
+
+	quiet = 1;
+
+	for (mode = IO_THREADS; mode <= IO_EPOLL; mode++)
+	{
+		for (count = 1; count <= MAX_VEHICLES; count *= 2)
+		{
+			nvehicles = 0;
+
+			for (k = 0; k < count; k++)
+			{
+				if (add_vehicle(bench_open_pty(&bench[k].master))->tty_fd < 0)
+					return -1;
+			}
+
+			for (k = 0; k < count; k++)
+				pthread_create(&bench[k].thread, NULL, SensorStreamThreadProc, &bench[k]);
+
+			event_loop = mode;
+
+			if (mode == IO_EPOLL)
+			{
+				pthread_create(&reactor, NULL, BenchReactorThreadProc, NULL);
+			}
+			else
+			{
+				thread_create(&watchdog_thread, &thread_configs[THREAD_WATCHDOG], WatchdogThreadProc, NULL);
+
+				for (k = 0; k < count; k++)
+				{
+					thread_create(&vehicles[k].comm_thread, &thread_configs[THREAD_COMM],
+						CommThreadProc, &vehicles[k]);
+					thread_create(&vehicles[k].intel_thread, &thread_configs[THREAD_INTEL],
+						IntelThreadProc, &vehicles[k]);
+				}
+			}
+
+			for (k = 0; k < count; k++)
+				pthread_join(bench[k].thread, NULL);
+
+			/* every car has stopped or given up, the control threads are idle */
+			if (mode == IO_EPOLL)
+			{
+				cpu = bench_thread_cpu_ms(reactor);
+			}
+			else
+			{
+				cpu = bench_thread_cpu_ms(watchdog_thread);
+
+				for (k = 0; k < count; k++)
+				{
+					cpu += bench_thread_cpu_ms(vehicles[k].comm_thread);
+					cpu += bench_thread_cpu_ms(vehicles[k].intel_thread);
+				}
+			}
+
+			request_stop();
+
+			if (mode == IO_EPOLL)
+			{
+				pthread_join(reactor, NULL);
+				close(decision_event_fd);
+				decision_event_fd = -1;
+			}
+			else
+			{
+				pthread_join(watchdog_thread, NULL);
+
+				for (k = 0; k < count; k++)
+				{
+					pthread_join(vehicles[k].comm_thread, NULL);
+					pthread_join(vehicles[k].intel_thread, NULL);
+				}
+			}
+
+			/* rearm the stop token for the next run */
+			eventfd_read(stop_fd, &ticks);
+			stop_requested = 0;
+
+			total = 0;
+			max = 0;
+			missed = 0;
+
+			for (k = 0; k < count; k++)
+			{
+				close(vehicles[k].tty_fd);
+				close(bench[k].master);
+				pthread_mutex_destroy(&vehicles[k].tty_mutex);
+
+				if (bench[k].stopped < 0)
+				{
+					missed++;
+					continue;
+				}
+
+				late = bench[k].stopped - bench[k].silent - cfg->sensor_deadline;
+				total += late;
+
+				if (late > max)
+					max = late;
+			}
+
+			printf("%-7s %2d cars: stopped %ld ms after the deadline on average, %ld ms at worst",
+				get_name_from_id(mode, io_modes, NELEMENTS(io_modes)), count,
+				(count > missed) ? total / (count - missed) : 0, max);
+
+			if (missed)
+				printf(", %d never stopped", missed);
+
+			printf("; control CPU %.2f ms per car\n", cpu / count);
+		}
+	}
+
+	nvehicles = 0;
+	event_loop = 0;
+	quiet = 0;
+
+	return 0;
+}
+
+#define BENCH_VISION_WIDTH	640
+#define BENCH_VISION_HEIGHT	480
+#define BENCH_VISION_PAD	64	/* bytes after each padded row */
+#define BENCH_VISION_FRAMES	40	/* per round */
+#define BENCH_VISION_ROUNDS	5
+
+/*
+	ms per full frame classification: of the same frame again, which
+	only looks pixels up, or alternating between two frames of noise,
+	where nearly every label and bin changes too.
+*/
+double bench_vision_time(color_classifier_t* classifier, classify_kernel_t kernel,
+	unsigned char** frames, int alternate)
+{
+	struct timespec start;
+	long best = LONG_MAX;
+	long elapsed;
+	int round;
+	int k;
+
+	color_classifier_reset(classifier);
+	kernel(classifier, frames[1], 0, 0, classifier->width, classifier->height);
+
+	/* the best of a few rounds, so a preempted round doesn't count */
+	for (round = 0; round < BENCH_VISION_ROUNDS; round++)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		for (k = 0; k < BENCH_VISION_FRAMES; k++)
+			kernel(classifier, frames[alternate ? (k & 1) : 1], 0, 0, classifier->width, classifier->height);
+
+		elapsed = bench_elapsed_us(&start);
+
+		if (elapsed < best)
+			best = elapsed;
+	}
+
+	return best / 1000.0 / BENCH_VISION_FRAMES;
+}
+
+/* times every classification kernel against the one reading the layout at run time */
+int run_vision_bench()
+{
+	color_classifier_t classifier = { .qualify = -1 };
+	unsigned char* frames[2];
+	unsigned char* labels;
+	classify_variant_t* variant;
+	double specialised;
+	double generic;
+	int alternate;
+	int size;
+	int step;
+	int k;
+	int i;
+
+	size = BENCH_VISION_HEIGHT * (BENCH_VISION_WIDTH * 4 + BENCH_VISION_PAD);
+	frames[0] = (unsigned char*) malloc(size);
+	frames[1] = (unsigned char*) malloc(size);
+	labels = (unsigned char*) malloc(BENCH_VISION_WIDTH * BENCH_VISION_HEIGHT);
 
-				break;
+	if (!frames[0] || !frames[1] || !labels ||
+		(color_classifier_prepare(&classifier, BENCH_VISION_WIDTH, BENCH_VISION_HEIGHT, cfg->qualify) < 0))
+	{
+		printf("cannot allocate frames!\n");
+		return 1;
+	}
 
-			case CMD_QUIT:
-				exit(0);
-				break;
+	srand(1);
+
+	for (i = 0; i < size; i++)
+	{
+		frames[0][i] = rand() & 0xFF;
+		frames[1][i] = rand() & 0xFF;
+	}
+
+	for (k = 0; k < NELEMENTS(classify_variants); k++)
+	{
+		variant = &classify_variants[k];
+		step = BENCH_VISION_WIDTH * variant->channels + (variant->packed ? 0 : BENCH_VISION_PAD);
+
+		color_classifier_layout(&classifier, variant->channels, step);
+
+		for (alternate = 0; alternate <= 1; alternate++)
+		{
+			generic = bench_vision_time(&classifier, classify_generic, frames, alternate);
+			memcpy(labels, classifier.labels, BENCH_VISION_WIDTH * BENCH_VISION_HEIGHT);
+			specialised = bench_vision_time(&classifier, variant->kernel, frames, alternate);
+
+			printf("%-13s %-9s %.3f ms per %dx%d frame, %.3f ms generic (%.2fx)%s\n",
+				variant->name, alternate ? "changing" : "steady", specialised,
+				BENCH_VISION_WIDTH, BENCH_VISION_HEIGHT, generic, generic / specialised,
+				memcmp(labels, classifier.labels, BENCH_VISION_WIDTH * BENCH_VISION_HEIGHT) ?
+					", labels differ!" : "");
 		}
 	}
 
-	pthread_exit(NULL);
+	color_classifier_free(&classifier);
+	free(frames[0]);
+	free(frames[1]);
+	free(labels);
+
+	return 0;
 }
 
-void* CommThreadProc(void* data)
+/*
+	Offline evaluation: --evaluate=<dataset> runs vision_analyse() and
+	vision_decide(), the code the cameras drive with, over labelled
+	frames and compares every decision with its label. A dataset is a
+	recording, whose frames are labelled with the decision recorded
+	with them, or a list of "<file> [<label>]" lines naming images or
+	recordings relative to the list; the label is one of victory, left,
+	forward, right or default, and a recording without one keeps its
+	recorded labels. The files are shared out to a thread per core, each
+	image on its own and each recording from its first frame on, so the
+	smoothing and the hysteresis run over it as they did on the car.
+*/
+#define EVAL_CLASSES		5
+#define EVAL_RECORDED		-3	/* label of a recording labelled frame by frame */
+
+static const int eval_directions[EVAL_CLASSES] = { -1, 1, 2, 3, -2 };
+static char* eval_class_names[EVAL_CLASSES] = { "victory", "left", "forward", "right", "default" };
+
+struct eval_item_s
+{
+	char* path;
+	int label;		/* a direction, or EVAL_RECORDED */
+};
+typedef struct eval_item_s eval_item_t;
+
+struct eval_worker_s
+{
+	pthread_t thread;
+	unsigned long confusion[EVAL_CLASSES][EVAL_CLASSES];	/* [label][decision] */
+	unsigned long frames;
+	unsigned long unreadable;
+};
+typedef struct eval_worker_s eval_worker_t;
+
+static eval_item_t* eval_items = NULL;
+static int eval_nitems = 0;
+static int eval_next = 0;	/* first item no worker has taken yet */
+
+int eval_class(int direction)
+{
+	int k;
+
+	for (k = 0; k < EVAL_CLASSES - 1; k++)
+	{
+		if (eval_directions[k] == direction)
+			return k;
+	}
+
+	return EVAL_CLASSES - 1;
+}
+
+int eval_add_item(char* path, int label)
+{
+	eval_item_t* items;
+
+	items = (eval_item_t*) realloc(eval_items, (eval_nitems + 1) * sizeof(eval_item_t));
+
+	if ((items == NULL) || (path == NULL))
+	{
+		printf("cannot allocate dataset!\n");
+		return -1;
+	}
+
+	eval_items = items;
+	eval_items[eval_nitems].path = path;
+	eval_items[eval_nitems].label = label;
+	eval_nitems++;
+
+	return 0;
+}
+
+/* adds the frames of a dataset to the evaluation */
+int eval_add_dataset(const char* dataset)
 {
-        uint8 comm = 0;
+	char line[512];
+	char file[384];
+	char label[16];
+	char* path;
+	int length;
+	int count;
+	int k;
+	FILE* list;
+
+	if (rec_is_recording(dataset))
+		return eval_add_item(strdup(dataset), EVAL_RECORDED);
+
+	if ((list = fopen(dataset, "r")) == NULL)
+	{
+		perror(dataset);
+		return -1;
+	}
+
+	/* paths are relative to the list */
+	length = strrchr(dataset, '/') ? strrchr(dataset, '/') - dataset + 1 : 0;
+
+	while (fgets(line, sizeof(line), list) != NULL)
+	{
+		if ((strchr(line, '#') != NULL))
+			*strchr(line, '#') = '\0';
+
+		if ((count = sscanf(line, "%383s %15s", file, label)) <= 0)
+			continue;
 
-        while (1)
-        {
-                if (read(tty_fd, &comm, 1) > 0)
-                {
-                        // printf("0x%02X\n", comm);
+		if (count == 1)
+		{
+			k = -1;
 
-			switch (comm)
+			if (!rec_is_recording(file))
 			{
-				case CMD_DIST_LEFT:
-					read(tty_fd, &comm, 1);
-					GLOBAL_SENSOR_LEFT = comm;
-					break;
+				printf("%s: %s has no label\n", dataset, file);
+				fclose(list);
+				return -1;
+			}
+		}
+		else
+		{
+			for (k = 0; (k < EVAL_CLASSES) && (strcmp(label, eval_class_names[k]) != 0); k++)
+				;
 
-				case CMD_DIST_RIGHT:
-					read(tty_fd, &comm, 1);
-					GLOBAL_SENSOR_RIGHT = comm;
-					break;
+			if (k == EVAL_CLASSES)
+			{
+				printf("%s: unknown label %s\n", dataset, label);
+				fclose(list);
+				return -1;
+			}
+		}
 
-				case CMD_DIST_CENTER:
-					read(tty_fd, &comm, 1);
-					GLOBAL_SENSOR_CENTER = comm;
-					break;
+		if ((path = (char*) malloc(length + strlen(file) + 1)) != NULL)
+		{
+			if (file[0] == '/')
+				strcpy(path, file);
+			else
+				sprintf(path, "%.*s%s", length, dataset, file);
+		}
 
-				case CMD_TEENSY_MODE:
-					read(tty_fd, &comm, 1);
-					GLOBAL_MODE = comm;
-					break;
+		if (eval_add_item(path, (k < 0) ? EVAL_RECORDED : eval_directions[k]) < 0)
+		{
+			fclose(list);
+			return -1;
+		}
+	}
+
+	fclose(list);
+
+	return 0;
+}
+
+/* decides on one frame and counts the decision against its label */
+void eval_frame(eval_worker_t* worker, vision_t* vision, vision_params_t* params,
+	IplImage* frame, int label, const char* path)
+{
+	int direction;
+	int status;
+
+	status = vision_analyse(vision, frame, params);
+
+	if (status == VISION_NO_MEMORY)
+	{
+		printf("%s: cannot allocate column histogram!\n", path);
+		worker->unreadable++;
+		return;
+	}
+
+	if (status == VISION_BAD_LAYOUT)
+	{
+		printf("%s: cannot analyse %d-channel frame\n", path, frame->nChannels);
+		worker->unreadable++;
+		return;
+	}
+
+	direction = vision_decide(&vision->filter, params);
+	worker->confusion[eval_class(label)][eval_class(direction)]++;
+	worker->frames++;
+}
+
+void* EvalThreadProc(void* data)
+{
+	eval_worker_t* worker = (eval_worker_t*) data;
+	vision_params_t params = { cfg->color, cfg->qualify, cfg->victory, cfg->direction };
+	vision_t vision;
+	rec_file_t rec;
+	IplImage* frame = NULL;
+	eval_item_t* item;
+	int label;
+	int next;
+	int k;
+
+	vision_init(&vision);
+
+	while ((next = __atomic_fetch_add(&eval_next, 1, __ATOMIC_RELAXED)) < eval_nitems)
+	{
+		item = &eval_items[next];
+		vision_restart(&vision);
+
+		if (!rec_is_recording(item->path))
+		{
+			cvReleaseImage(&frame);
 
+			if ((frame = cvLoadImage(item->path, CV_LOAD_IMAGE_COLOR)) == NULL)
+			{
+				printf("%s: cannot load image\n", item->path);
+				worker->unreadable++;
+				continue;
 			}
-                }
-        }
 
-        pthread_exit(NULL);
+			eval_frame(worker, &vision, &params, frame, item->label, item->path);
+			continue;
+		}
+
+		if (rec_open(item->path, &rec) < 0)
+		{
+			printf("%s: not a recording\n", item->path);
+			worker->unreadable++;
+			continue;
+		}
+
+		for (k = 0; k < rec.count; k++)
+		{
+			label = (item->label == EVAL_RECORDED) ? rec_header(&rec, k)->direction : item->label;
+
+			if (rec_decode(&rec, k, &frame) < 0)
+			{
+				printf("%s: frame %d is damaged\n", item->path, k);
+				worker->unreadable++;
+				continue;
+			}
+
+			eval_frame(worker, &vision, &params, frame, label, item->path);
+		}
+
+		rec_close(&rec);
+	}
+
+	cvReleaseImage(&frame);
+	vision_free(&vision);
+
+	return NULL;
+}
+
+int run_evaluation()
+{
+	thread_config_t worker_config = thread_configs[THREAD_EVALUATE];
+	unsigned long confusion[EVAL_CLASSES][EVAL_CLASSES] = { { 0 } };
+	unsigned long frames = 0;
+	unsigned long unreadable = 0;
+	unsigned long correct = 0;
+	unsigned long total;
+	eval_worker_t* workers;
+	struct timespec start;
+	calibration_t cal;
+	double seconds;
+	int nworkers;
+	int ncpus;
+	int k;
+	int i;
+	int j;
+
+	if (cfg->calibration[0] != '\0')
+	{
+		if (calibration_load(cfg->calibration, &cal) < 0)
+			return 1;
+
+		calibration_set(&cal);
+	}
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nworkers = (ncpus < eval_nitems) ? ncpus : eval_nitems;
+
+	if ((workers = (eval_worker_t*) calloc(nworkers, sizeof(eval_worker_t))) == NULL)
+	{
+		printf("cannot allocate workers!\n");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (k = 0; k < nworkers; k++)
+	{
+		worker_config.cpu = k % ncpus;
+		thread_create(&workers[k].thread, &worker_config, EvalThreadProc, &workers[k]);
+	}
+
+	for (k = 0; k < nworkers; k++)
+	{
+		pthread_join(workers[k].thread, NULL);
+
+		for (i = 0; i < EVAL_CLASSES; i++)
+		{
+			for (j = 0; j < EVAL_CLASSES; j++)
+				confusion[i][j] += workers[k].confusion[i][j];
+		}
+
+		frames += workers[k].frames;
+		unreadable += workers[k].unreadable;
+	}
+
+	seconds = bench_elapsed_us(&start) / 1e6;
+
+	printf("%lu frames of %d files in %.2f s on %d threads: %.1f frames/s, %.1f per thread",
+		frames, eval_nitems, seconds, nworkers, frames / seconds, frames / seconds / nworkers);
+
+	if (unreadable)
+		printf(", %lu unreadable", unreadable);
+
+	printf("\n%-8s %8s %9s   decided as:", "label", "frames", "accuracy");
+
+	for (j = 0; j < EVAL_CLASSES; j++)
+		printf(" %8s", eval_class_names[j]);
+
+	printf("\n");
+
+	for (i = 0; i < EVAL_CLASSES; i++)
+	{
+		for (j = 0, total = 0; j < EVAL_CLASSES; j++)
+			total += confusion[i][j];
+
+		correct += confusion[i][i];
+
+		if (total == 0)
+			continue;
+
+		printf("%-8s %8lu %8.1f%%              ", eval_class_names[i], total, 100.0 * confusion[i][i] / total);
+
+		for (j = 0; j < EVAL_CLASSES; j++)
+			printf(" %8lu", confusion[i][j]);
+
+		printf("\n");
+	}
+
+	if (frames)
+		printf("overall accuracy %.1f%%\n", 100.0 * correct / frames);
+
+	free(workers);
+
+	for (k = 0; k < eval_nitems; k++)
+		free(eval_items[k].path);
+
+	free(eval_items);
+
+	return (unreadable == 0) ? 0 : 1;
+}
+
+/* voluntary and involuntary switches of all threads since startup */
+void print_context_switch_report()
+{
+	struct rusage usage;
+	struct timespec now;
+	long elapsed_ms;
+	long switches;
+
+	getrusage(RUSAGE_SELF, &usage);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	elapsed_ms = timespec_diff_ms(&now, &start_time);
+	switches = usage.ru_nvcsw + usage.ru_nivcsw;
+
+	if (elapsed_ms <= 0)
+		return;
+
+	printf("%s: %ld context switches in %ld ms (%.1f/s, %ld voluntary)\n",
+		(event_loop == 2) ? "io_uring" : (event_loop ? "event loop" : "threads"),
+		switches, elapsed_ms,
+		(1000.0 * switches) / elapsed_ms, usage.ru_nvcsw);
 }
 
 int main(int argc, char** argv)
 {
 	fd_set rdset;
-	char* tty_dev;
 	struct termios tio;
+	speed_t speed;
+	calibration_t cal;
 	uint8 b = 0;
+	char* value;
+	int arg_index;
+	int bench_io = 0;
+	int bench_vehicles = 0;
+	int bench_vision = 0;
+	int tty_fd;
+	int k;
+	struct timespec now;
+	sigset_t sigset;
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	atexit(print_context_switch_report);
+	main_thread = pthread_self();
+
+	/* a scraper or the dongle hanging up must not kill us */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* every thread inherits the mask, the signals are read from signal_fd */
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	signal_fd = signalfd(-1, &sigset, 0);
+	stop_fd = eventfd(0, 0);
+
+	/* the config file goes first, wherever it is named, so the command line overrides it */
+	for (arg_index = 1; arg_index < argc; arg_index++)
+	{
+		if ((strncmp(argv[arg_index], "--config=", 9) == 0) &&
+			(config_load(&config, argv[arg_index] + 9) < 0))
+		{
+			return 1;
+		}
+	}
+
+	for (arg_index = 1; arg_index < argc; arg_index++)
+	{
+		if (strncmp(argv[arg_index], "--config=", 9) == 0)
+		{
+			continue;
+		}
+		else if (strcmp(argv[arg_index], "--help") == 0)
+		{
+			print_config_options();
+			return 0;
+		}
+		else if (strcmp(argv[arg_index], "--bench-io") == 0)
+		{
+			bench_io = 1;
+		}
+		else if (strcmp(argv[arg_index], "--bench-vehicles") == 0)
+		{
+			bench_vehicles = 1;
+		}
+		else if (strcmp(argv[arg_index], "--bench-vision") == 0)
+		{
+			bench_vision = 1;
+		}
+		else if (strncmp(argv[arg_index], "--evaluate=", 11) == 0)
+		{
+			if (eval_add_dataset(argv[arg_index] + 11) < 0)
+				return 1;
+		}
+		else if (strcmp(argv[arg_index], "--event-loop") == 0)
+		{
+			config.io = IO_EPOLL;
+		}
+		else if (strcmp(argv[arg_index], "--io-uring") == 0)
+		{
+			config.io = IO_URING;
+		}
+		else if (strncmp(argv[arg_index], "--", 2) == 0)
+		{
+			value = strchr(argv[arg_index], '=');
+
+			if (value != NULL)
+				*value++ = '\0';
+
+			if (config_set(&config, argv[arg_index] + 2, value, 1) < 0)
+				return 1;
+		}
+		else if (config_set(&config, "device", argv[arg_index], 1) < 0)
+		{
+			return 1;
+		}
+	}
+
+	if (bench_io)
+		return run_io_bench();
+
+	if (bench_vehicles)
+		return run_vehicle_bench();
+
+	if (bench_vision)
+		return run_vision_bench();
+
+	if (eval_nitems > 0)
+		return run_evaluation();
+
+	speed = get_baud_speed(cfg->baud);
 
-	tty_dev = default_tty_dev;
+	if (speed == B0)
+	{
+		printf("unsupported baud rate!\n");
+		return 1;
+	}
+
+	if (cfg->ndevices == 0)
+		config_set(&config, "device", DEFAULT_TTY_DEV, 0);
+
+	for (k = 0; k < cfg->ndevices; k++)
+	{
+		printf("using device: %s\n", cfg->device[k]);
+
+		/* a car without its link would only look like it is driving */
+		if ((tty_fd = open(cfg->device[k], O_RDWR | O_NONBLOCK)) < 0)
+		{
+			perror(cfg->device[k]);
+			return 1;
+		}
+
+		add_vehicle(tty_fd);
+	}
+
+	if (cfg->ncameras == 0)
+		config_set(&config, "camera", "0", 0);
+
+	for (k = 0; k < cfg->ncameras; k++)
+	{
+		if (add_camera(strdup(cfg->camera[k])) < 0)
+		{
+			printf("camera %s steers no car!\n", cfg->camera[k]);
+			return 1;
+		}
+	}
 
-	if (argc > 1)
+	if ((cfg->metrics[0] != '\0') && ((metrics_fd = metrics_listen(cfg->metrics)) < 0))
 	{
-		printf("using device: %s\n", argv[1]);
-		tty_dev = argv[1];
+		printf("cannot open metrics endpoint!\n");
+		return 1;
 	}
 
-	printf("command syntax: <command>:<value>\n");
+	if (cfg->calibration[0] != '\0')
+	{
+		if (calibration_load(cfg->calibration, &cal) < 0)
+			return 1;
+
+		calibration_set(&cal);
+	}
+
+	if (cfg->debug_stream != 0)
+	{
+		if (((debug_fd = loopback_listen(cfg->debug_stream, "debug-stream")) < 0) ||
+			((debug_event_fd = eventfd(0, EFD_NONBLOCK)) < 0))
+		{
+			printf("cannot open the debug stream!\n");
+			return 1;
+		}
+
+		printf("debug stream on http://127.0.0.1:%d/<camera>\n", cfg->debug_stream);
+	}
+
+	printf("Detecting %s\n", get_color_name(cfg->color));
+
+	vision_params_set(offsetof(vision_params_t, color), cfg->color);
+	vision_params_set(offsetof(vision_params_t, qualify), cfg->qualify);
+	vision_params_set(offsetof(vision_params_t, victory), cfg->victory);
+	vision_params_set(offsetof(vision_params_t, direction), cfg->direction);
+
+	event_loop = cfg->io;
+
+	printf("command syntax: <command>:<value>[;<command>:<value>...]\n");
 	print_command_list();
 
 	memset(&tio, 0, sizeof(tio));
@@ -790,25 +7729,114 @@ int main(int argc, char** argv)
 	tio.c_cc[VMIN] = 1;
 	tio.c_cc[VTIME] = 5;
 
-	tty_fd = open(tty_dev, O_RDWR | O_NONBLOCK);
-	cfsetospeed(&tio, B9600); /* baud */
-	cfsetispeed(&tio, B9600); /* baud */
+	cfsetospeed(&tio, speed); /* baud */
+	cfsetispeed(&tio, speed); /* baud */
+
+	for (k = 0; k < nvehicles; k++)
+		tcsetattr(vehicles[k].tty_fd, TCSANOW, &tio);
+
+	/*
+		First stage: the serial links, the REPL, the watchdog and the
+		controllers, which send their first command as soon as they run.
+		In event loop mode the reactor below is all of that.
+	*/
+	if (!event_loop)
+	{
+		thread_create(&cmd_thread, &thread_configs[THREAD_CMD], CmdThreadProc, NULL);
+		thread_create(&watchdog_thread, &thread_configs[THREAD_WATCHDOG], WatchdogThreadProc, NULL);
+
+		for (k = 0; k < nvehicles; k++)
+		{
+			thread_create(&vehicles[k].comm_thread, &thread_configs[THREAD_COMM],
+				CommThreadProc, &vehicles[k]);
+			thread_create(&vehicles[k].intel_thread, &thread_configs[THREAD_INTEL],
+				IntelThreadProc, &vehicles[k]);
+		}
+	}
+
+	thread_create(&init_thread, &thread_configs[THREAD_INIT], InitThreadProc, NULL);
+
+	if (event_loop)
+	{
+		/* fall back to epoll on kernels without io_uring */
+		if ((event_loop == 1) || (run_uring_loop() < 0))
+		{
+			if (event_loop == 2)
+				printf("io_uring unavailable, using epoll\n");
+
+			event_loop = 1;
+			run_event_loop();
+		}
+	}
+	else
+	{
+		/* a signal asks for the same shutdown as the quit command */
+		if (!stop_wait(signal_fd, POLLIN, -1))
+			request_stop();
+	}
+
+	/* the init thread started the cameras, telemetry and metrics */
+	pthread_join(init_thread, NULL);
+
+	/* joined first, while the threads it reports on still exist */
+	if (metrics_fd >= 0)
+		pthread_join(metrics_thread, NULL);
+
+	if (debug_fd >= 0)
+		pthread_join(debug_thread, NULL);
 
-	tcsetattr(tty_fd, TCSANOW, &tio);
+	if (!event_loop)
+	{
+		pthread_join(cmd_thread, &cmd_thread_status);
+		pthread_join(bt_thread, &bt_thread_status);
+		pthread_join(watchdog_thread, &watchdog_thread_status);
+
+		for (k = 0; k < nvehicles; k++)
+		{
+			pthread_join(vehicles[k].comm_thread, NULL);
+			pthread_join(vehicles[k].intel_thread, NULL);
+		}
+	}
+
+	for (k = 0; k < ncameras; k++)
+		pthread_join(cameras[k].thread, &cameras[k].thread_status);
+
+	/* what the cameras left in the rings is still written */
+	for (k = 0; k < ncameras; k++)
+		recorder_stop(&recorders[k]);
+
+	debug_stream_free();
 
-	pthread_create(&cmd_thread, NULL, CmdThreadProc, NULL);
-	pthread_create(&comm_thread, NULL, CommThreadProc, NULL);
-	pthread_create(&intel_thread, NULL, IntelThreadProc, NULL);
-	pthread_create(&bt_thread, NULL, BTThreadProc, NULL);
-	pthread_create(&camera_thread, NULL, CameraThreadProc, NULL);
+	/* leave the cars stopped, whatever the controllers were doing */
+	for (k = 0; k < nvehicles; k++)
+		send_command(&vehicles[k], CMD_SPEED, 0);
+
+	for (k = 0; k < nvehicles; k++)
+		tcdrain(vehicles[k].tty_fd);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	printf("shutdown took %ld ms\n", timespec_diff_ms(&now, &stop_time));
+
+	if (decision_event_fd >= 0)
+		close(decision_event_fd);
+
+	if (metrics_fd >= 0)
+		close(metrics_fd);
+
+	if (metrics_path != NULL)
+		unlink(metrics_path);
+
+	if (debug_fd >= 0)
+	{
+		close(debug_fd);
+		close(debug_event_fd);
+	}
 
-	pthread_join(cmd_thread, cmd_thread_status);
-	pthread_join(comm_thread, &comm_thread_status);
-	pthread_join(intel_thread, &intel_thread_status);
-	pthread_join(bt_thread, &bt_thread_status);
-	pthread_join(camera_thread, &camera_thread_status);
+	close(signal_fd);
+	close(stop_fd);
 
-	close(tty_fd);
+	for (k = 0; k < nvehicles; k++)
+		close(vehicles[k].tty_fd);
 
 	return 0;
 }